@@ -0,0 +1,216 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Headless benchmark of the page path, built by make bench into comic.c in
+ * place of its main. Every page of the inputs is read, decoded to fit the
+ * view and scaled into a frame, as a page turn without prefetch would. */
+#include <sys/resource.h>
+#include <time.h>
+
+enum {
+    StageRead,
+    StageDecode,
+    StageScale,
+    StagePage,
+    StageLast,
+};
+
+static const char *stagenames[] = {
+    [StageRead] = "read",
+    [StageDecode] = "decode",
+    [StageScale] = "scale",
+    [StagePage] = "page",
+};
+
+typedef struct {
+    double *v;
+    size_t count, size;
+} Samples;
+
+static Samples samples[StageLast];
+static uint32_t *benchframe;
+static size_t pages, skipped, pixels;
+
+static double
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+addsample(Samples *s, double v) {
+    if(s->count == s->size) {
+        s->size = s->size ? s->size * 2 : 256;
+        if(!(s->v = realloc(s->v, s->size * sizeof(double))))
+            die("Failed to allocate samples\n");
+    }
+    s->v[s->count++] = v;
+}
+
+static int
+cmpdouble(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* of sorted samples */
+static double
+percentile(Samples *s, double p) {
+    size_t i;
+
+    if(!s->count)
+        return 0;
+    i = p * (s->count - 1) + .5;
+    return s->v[i];
+}
+
+static void
+benchpage(Node *container, int idx) {
+    char *name;
+    double t[4], resizeratio;
+    Stream *s;
+    Node *image;
+    vec2 size, anchor;
+
+    t[0] = now();
+    if(container->type == FileList && decoder(sniffile(FL(container).filenames[idx])) == -1) {
+        skipped++;
+        return;
+    }
+    if(!(s = openentry(container, idx, &name)))
+        die("failed to read entry %d of %s\n", idx, container->name);
+    t[1] = now();
+    image = imagenode(NULL, name, s, viewsize, 0);
+    closestream(s);
+    free(name);
+    t[2] = now();
+    if(!image) {
+        skipped++;
+        return;
+    }
+
+    if(vec2_ratio(IMG(image).full) > vec2_ratio(viewsize))
+        resizeratio = (double)viewsize.x / IMG(image).full.x;
+    else
+        resizeratio = (double)viewsize.y / IMG(image).full.y;
+    size = vec2_scale(IMG(image).full, resizeratio);
+    size.x = MIN(MAX(size.x, 1), viewsize.x);
+    size.y = MIN(MAX(size.y, 1), viewsize.y);
+    anchor = vec2_scale(vec2_add(viewsize, vec2_scale(size, -1)), .5f);
+    resample(IMG(image).imagebuf, IMG(image).size.x, IMG(image).size.y,
+            IMG(image).size.x * PIXELSIZE(IMG(image).format), IMG(image).format,
+            benchframe + anchor.y * viewsize.x + anchor.x, viewsize.x,
+            size.x, size.y, filter);
+    t[3] = now();
+
+    pixels += (size_t)IMG(image).full.x * IMG(image).full.y;
+    cleanupnode(image);
+    addsample(&samples[StageRead], t[1] - t[0]);
+    addsample(&samples[StageDecode], t[2] - t[1]);
+    addsample(&samples[StageScale], t[3] - t[2]);
+    addsample(&samples[StagePage], t[3] - t[0]);
+    pages++;
+}
+
+static void
+benchfile(Node *filelist, int idx) {
+#ifdef ARCHIVE
+    Node *archive;
+    int i;
+
+    if(decoder(sniffile(FL(filelist).filenames[idx])) != -1 ||
+            !(archive = archivenode(filelist, FL(filelist).filenames[idx]))) {
+        benchpage(filelist, idx);
+        return;
+    }
+    for(i = 0; i < AR(archive).count; i++)
+        benchpage(archive, i);
+    cleanupnode(archive);
+#else
+    benchpage(filelist, idx);
+#endif
+}
+
+void
+usage(void) {
+    fputs("usage: comic-bench [-f filter] [-g WxH] [-r repeat] filename...\n", stderr);
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[]) {
+    int i, r, repeat = 1;
+    char *arg;
+    double start, elapsed;
+    struct rusage ru;
+    Node *filelist;
+
+    ARGBEGIN {
+    case 'f':
+        arg = EARGF(usage());
+        for(filter = 0; filter < FilterLast && strcasecmp(arg, filtername(filter)); filter++);
+        if(filter == FilterLast)
+            usage();
+        break;
+    case 'g':
+        if(sscanf(EARGF(usage()), "%dx%d", &viewsize.x, &viewsize.y) != 2 ||
+                viewsize.x <= 0 || viewsize.y <= 0)
+            usage();
+        break;
+    case 'r':
+        repeat = atoi(EARGF(usage()));
+        repeat = MAX(repeat, 1);
+        break;
+    default:
+        usage();
+    } ARGEND;
+
+    if(argc == 0)
+        usage();
+    if(!viewsize.x)
+        viewsize = (vec2){ .x = 1920, .y = 1080 };
+    if(!(benchframe = calloc((size_t)viewsize.x * viewsize.y, sizeof(uint32_t))))
+        die("Failed to allocate the frame\n");
+
+    filelist = malloc(sizeof(Node));
+    *filelist = (Node){
+        .type = FileList,
+        .name = strdup("bench"),
+        .u = { .filelist = { .count = argc, .filenames = argv } }
+    };
+
+    poolinit(POOL_IDLE, POOL_HUGEPAGES);
+#ifdef TRACE
+    traceinit();
+#endif
+    start = now();
+    for(r = 0; r < repeat; r++)
+        for(i = 0; i < argc; i++)
+            benchfile(filelist, i);
+    elapsed = now() - start;
+
+    printf("%d files, %zu pages, %zu skipped, %dx%d %s\n", argc, pages, skipped,
+            viewsize.x, viewsize.y, filtername(filter));
+    printf("%-8s %10s %10s %10s\n", "stage", "p50 ms", "p99 ms", "total s");
+    for(i = 0; i < StageLast; i++) {
+        double total = 0;
+        size_t j;
+        for(j = 0; j < samples[i].count; j++)
+            total += samples[i].v[j];
+        qsort(samples[i].v, samples[i].count, sizeof(double), cmpdouble);
+        printf("%-8s %10.3f %10.3f %10.3f\n", stagenames[i],
+                percentile(&samples[i], .5) * 1e3, percentile(&samples[i], .99) * 1e3, total);
+        free(samples[i].v);
+    }
+    printf("%.1f pages/s, %.1f Mpixel/s\n", pages / elapsed, pixels / elapsed / 1e6);
+    getrusage(RUSAGE_SELF, &ru);
+    printf("peak RSS %ld KiB\n", ru.ru_maxrss);
+    poolreport(stdout);
+
+    free(benchframe);
+    cleanupnode(filelist);
+#ifdef TRACE
+    tracedump();
+#endif
+    return EXIT_SUCCESS;
+}
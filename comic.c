@@ -1,27 +1,52 @@
 #include "arg.h"
 
+#include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ipc.h>
+#include <sys/mman.h>
+#include <sys/shm.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <X11/keysym.h>
 #include <X11/Xatom.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#ifdef XRENDER
+#include <X11/extensions/Xrender.h>
+#endif
 #include <jpeglib.h>
 #include <jerror.h>
+#ifdef PNG
+#include <png.h>
+#endif
+#ifdef WEBP
+#include <webp/decode.h>
+#endif
+
+#include "pool.h"
+#include "resample.h"
+#include "trace.h"
 
 /* macros */
 #define CLEANMASK(mask)         (mask & ~(LockMask) & (ShiftMask|ControlMask|Mod1Mask|Mod2Mask|Mod3Mask|Mod4Mask|Mod5Mask))
 #define MAX(A, B)               ((A) > (B) ? (A) : (B))
 #define MIN(A, B)               ((A) < (B) ? (A) : (B))
 #define LENGTH(X)               (sizeof X / sizeof X[0])
+#define FRAMEORDER              (pixelformat == XRGB32 ? MSBFirst : LSBFirst)
 
 typedef union {
     int i;
@@ -53,8 +78,20 @@ enum {
     Page,
     Archive,
     FileList,
+    Directory,      /* a FileList of the tree under a directory, listed as it is read */
 } Type;
 
+/* what the first bytes of a file tell, see sniff() */
+enum {
+    FileUnknown,
+    FileJPEG,
+    FilePNG,
+    FileWebP,
+    FileArchive,    /* a format or compression libarchive reads */
+};
+
+#define SNIFF_SIZE 512
+
 typedef struct vec2 vec2;
 struct vec2 { int x, y; };
 static double vec2_ratio(vec2 v) { return (double)v.x / v.y; }
@@ -62,11 +99,17 @@ static vec2 vec2_scale(vec2 v, double r) { v.x *= r; v.y *= r; return v; }
 static vec2 vec2_add(vec2 v1, vec2 vec2) { v1.x += vec2.x; v1.y += vec2.y; return v1; }
 
 typedef struct Node Node;
+typedef struct Entry Entry;
 
 typedef Node* (*loadnextfunc)(Node*);
 typedef int (*moveoffsetfunc)(Node*, int);
 typedef char *(*gentitlefunc)(Node*, char *);
 typedef void (*cleanupfunc)(Node*);
+typedef struct Stream Stream;
+typedef Stream *(*openentryfunc)(Node*, int, char **);
+typedef struct ThumbHeader ThumbHeader;
+typedef struct Mip Mip;
+typedef struct Scan Scan;
 
 struct Node {
     int type;
@@ -77,11 +120,22 @@ struct Node {
     moveoffsetfunc moveoffset;
     gentitlefunc gentitle;
     cleanupfunc cleanup;
+    openentryfunc openentry;
+
+    ThumbHeader *thumbs;    /* of the entries of a container, once in the grid */
+    size_t thumbslen;
+    int thumbsfd;           /* of the file mapped, -1 when in memory */
+    uint32_t *stamps;       /* of the loose files, see ThumbSlot */
+    int nstamps;
 
     union {
         struct {
             unsigned char *imagebuf;
-            vec2 size;
+            int format;         /* of imagebuf, see resample.h */
+            vec2 size, full;    /* decoded and original size */
+            int scale;          /* decoded at scale/8 of the original */
+            Mip *mips;          /* halved copies, made by render */
+            int nmips;
         } image;
         struct {
             int count;
@@ -90,17 +144,36 @@ struct Node {
         struct {
             int idx, count;
             char * const * filenames;
+            Scan *scan;         /* of a Directory */
         } filelist;
 #ifdef ARCHIVE
         struct {
             struct archive *a;
-            int idx, count;
-            struct archive_entry *entry;
+            pthread_mutex_t lock;
+            int fd, kind, pos, idx, count;
+            Entry *entries;
+            char *names;
+            size_t namelen, maplen, filelen;
+            void *map;
+            char *file;         /* the whole zip, stored entries are read in place */
         } archive;
 #endif
     } u;
 };
 
+/* The bytes of an entry, size of them at data. next replaces them with the
+ * following ones and returns 0 at the end, when there is more than one
+ * buffer. buf, from poolget, is given back on close. Decoders give up when
+ * cancel gets set. */
+struct Stream {
+    const unsigned char *data;
+    size_t size;
+    int (*next)(Stream *s);
+    void (*close)(Stream *s);
+    void *buf;
+    int *cancel;
+};
+
 #define IMG(node) ((node)->u.image)
 #define PG(node) ((node)->u.page)
 #define FL(node) ((node)->u.filelist)
@@ -109,36 +182,104 @@ static Display *dpy;
 static Window win;
 static int screen;
 static GC gc;
+static XImage *frame;   /* window sized, pages are drawn into it */
+static Pixmap backbuf;  /* frame on the server, exposed parts are copied from it */
+static vec2 backsize;
+static Region damage;   /* exposed since the last copy */
+static XShmSegmentInfo shminfo;
+static Bool useshm;
+static Bool shmfailed;
+static Bool composited; /* the page was scaled by the server, resizes are cheap */
+#ifdef XRENDER
+static Bool userender;
+static XRenderPictFormat *renderformat;
+static Picture backpict;    /* of backbuf, pages are composited into it */
+#endif
+static int pixelformat = BGRX32;    /* of frame, and of decoded images when possible */
 
 Node *node, *curnode;
 static Bool running = True;
 static char *wmname = "comic";
 static int imageperpage = 1;
+static int gridmode, gridsel, gridtop;  /* overview, selected and first shown row */
+static double zoom = 1;                 /* of the page fitting the view */
+static double centerx, centery;         /* of the view on the page, in fractions of it */
+static int dirty;                       /* the frame is rendered again by run() */
+static int pendingseek;                 /* seeks which run() does as one */
+static int pendingpage = INT_MIN;       /* of a seekabs() waiting for the page index */
+static long resized;                    /* ms of the last ConfigureNotify, until rendered */
+static int skipbad;                     /* pages which fail to decode are skipped, -T */
+static __thread jmp_buf *decodefail;    /* where a skipped decode of the thread goes */
 vec2 viewsize;
 
 char *argv0;
 
 static char *readfile(const char *filename, size_t *size);
+static Stream *memstream(const void *data, size_t size, void *buf);
+static Stream *openentry(Node *container, int idx, char **name);
+static void closestream(Stream *s);
 static int moveoffset(int offset);
-static Node *imagenode(Node * parent, const char *name, char *data, size_t size);
+static int shownentry(Node *container);
+static int globalpage(void);
+static int seekpage(int page);
+static Node *opencontainer(Node *node);
+static Node *imagenode(Node * parent, const char *name, Stream *s, vec2 fit, int preview);
+static Node *loadimage(Node *container, int idx);
 static Node *pagenode(Node * parent, Node **images, int count);
+static void position(Node *container, int *idx, int *count);
+static const char *entryname(Node *container, int idx);
 static void cleanupnode(Node *node);
 static void cleanup(void);
-static void decodejpeg(void *buf, size_t size, Node *nodeout);
+static int dctscale(vec2 full, vec2 fit);
+static void decodejpeg(Stream *s, Node *nodeout, vec2 fit, int preview);
+#ifdef PNG
+static void decodepng(Stream *s, Node *nodeout, vec2 fit, int preview);
+#endif
+#ifdef WEBP
+static void decodewebp(Stream *s, Node *nodeout, vec2 fit, int preview);
+#endif
+static int sniff(const unsigned char *p, size_t n);
 static void die(const char *errstr, ...);
+static void decodeerror(const char *errstr, ...);
 static char *gentitle(Node *node);
 static void jpegerrorexit (j_common_ptr ci);
 static void loadnext(void);
+static void prefetch(void);
+static void prefetchcancel(Node *container);
+static int refreshpage(void);
+static void *prefetchworker(void *arg);
+static void thumbload(Node *container, int idx);
+static int thumbmade(Node *container, int idx);
+static uint32_t thumbstamp(Node *container, int idx);
+static void putthumb(Node *container, int idx, Node *image);
+static void growthumbs(Node *container);
 static void render(void);
 static void run(void);
 static void setup(void);
 static void usage(void);
 static void xsettitle(Window w, const char *str);
+static void settitle(void);
 static Window createwindow(Display *dpy, int screen, int x, int y, int w, int h);
-static XImage *createimage(Node *node, vec2 size);
+static void createbackbuf(vec2 size);
+static XImage *createframe(vec2 size);
+static void destroyframe(void);
+static void clearframe(int x, int y, int w, int h);
 static void quit(const Arg *arg);
 static void seek(const Arg *arg);
 static void seekabs(const Arg *arg);
+static void shiftimage(const Arg *arg);
+static void flushseek(void);
+static void cyclefilter(const Arg *arg);
+static void zoomview(const Arg *arg);
+static void panx(const Arg *arg);
+static void pany(const Arg *arg);
+static void togglegrid(const Arg *arg);
+static void gridmove(const Arg *arg);
+static void gridrow(const Arg *arg);
+static void gridselect(const Arg *arg);
+static void putframe(void);
+static void showframe(void);
+static void rendergrid(void);
 static void buttonpress(XEvent *e);
 static void configurenotify(XEvent *e);
 static void expose(XEvent *e);
@@ -147,6 +288,42 @@ static void keypress(XEvent *e);
 /* configuration, allows nested code to access above variables */
 #include "config.h"
 
+#define KEYHASH 0xcbf29ce484222325ULL
+
+/* FNV-1a of the string on top of hash, KEYHASH to start a key */
+static uint64_t
+keyhash(uint64_t hash, const char *s) {
+    for(; *s; s++)
+        hash = (hash ^ (unsigned char)*s) * 0x100000001b3ULL;
+    return hash;
+}
+
+/* $XDG_CACHE_HOME/comic/<hash of key><ext>, creating the directory */
+static char *
+cachepath(uint64_t hash, const char *ext) {
+    char *dir, *file, *p;
+    const char *home;
+
+    if((home = getenv("XDG_CACHE_HOME")) && *home)
+        asprintf(&dir, "%s/comic", home);
+    else if((home = getenv("HOME")))
+        asprintf(&dir, "%s/.cache/comic", home);
+    else
+        return NULL;
+
+    for(p = dir + 1; *p; p++)
+        if(*p == '/') {
+            *p = '\0';
+            mkdir(dir, 0755);
+            *p = '/';
+        }
+    mkdir(dir, 0755);
+
+    asprintf(&file, "%s/%016llx%s", dir, (unsigned long long)hash, ext);
+    free(dir);
+    return file;
+}
+
 #ifdef ARCHIVE
 // Archived image support
 #include <archive_entry.h>
@@ -159,109 +336,479 @@ openarchive(const char *filename) {
     struct archive *a = archive_read_new();
     archive_read_support_filter_all(a);
     archive_read_support_format_all(a);
-    if(archive_read_open_filename(a, filename, ARCHIVE_BLOCK_SIZE) != ARCHIVE_OK)
+    if(archive_read_open_filename(a, filename, ARCHIVE_BLOCK_SIZE) != ARCHIVE_OK) {
+        archive_read_free(a);
         return NULL;
+    }
     return a;
 }
 
-static Node*
-archiveloadnext(Node *node) {
-    char *data;
-    int i, ret;
-    size_t size, read;
-    struct archive *a = AR(node).a;
-    struct archive_entry *entry;
+/* How entries of an indexed archive are read back */
+enum {
+    Zip,        /* offsets of local headers, from the central directory */
+    Tar,        /* offsets of headers in an uncompressed tar */
+    Sequential, /* compressed streams: walk the shared handle */
+};
 
-    Node **images = malloc(sizeof(Node *) * imageperpage);
-    for(i = 0; i < imageperpage; i++) {
-        if((ret = archive_read_next_header(a, &entry)) == ARCHIVE_EOF)
-            break;
-        else if(ret != ARCHIVE_OK)
-            die("Failed to read archive: %s\n", archive_error_string(a));
+struct Entry {
+    uint64_t offset, size, csize;
+    uint32_t name;      /* offset in the name table */
+    uint16_t method;    /* zip compression method, 0 is stored */
+};
 
-        if((archive_entry_filetype(entry) & AE_IFDIR) ||
-                (size = archive_entry_size(entry)) > IMAGE_SIZE_LIMIT)
-            continue;
+/* On-disk index cache: the header, the entries, the archive path and the
+ * name table, mapped back as is when the archive has not changed */
+typedef struct {
+    char magic[8];
+    uint32_t version, kind, count, pathlen;
+    uint64_t size, namelen;
+    int64_t mtime, mtimensec;
+} IndexHeader;
+
+#define INDEX_MAGIC "comicidx"
+#define INDEX_VERSION 2
+
+typedef struct {
+    int fd;
+    off_t offset;
+    char buf[ARCHIVE_BLOCK_SIZE];
+} Reader;
+
+static uint16_t le16(const unsigned char *p) { return p[0] | p[1] << 8; }
+static uint32_t le32(const unsigned char *p) { return le16(p) | (uint32_t)le16(p + 2) << 16; }
+static uint64_t le64(const unsigned char *p) { return le32(p) | (uint64_t)le32(p + 4) << 32; }
+
+/* Skip directories, they are never shown as pages.
+ * Warnings, like names not convertible to the locale, are not fatal. */
+static int
+archivenextfile(struct archive *a, struct archive_entry **entry) {
+    int ret;
+    while((ret = archive_read_next_header(a, entry)) == ARCHIVE_OK || ret == ARCHIVE_WARN)
+        if(!(archive_entry_filetype(*entry) & AE_IFDIR))
+            return ARCHIVE_OK;
+    return ret;
+}
+
+static void
+addentry(Node *node, int *cap, size_t *namecap, Entry e, const char *name, size_t len) {
+    if(AR(node).count == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        AR(node).entries = realloc(AR(node).entries, *cap * sizeof(Entry));
+    }
+    while(AR(node).namelen + len + 1 > *namecap) {
+        *namecap = *namecap ? *namecap * 2 : 4096;
+        AR(node).names = realloc(AR(node).names, *namecap);
+    }
+    e.name = AR(node).namelen;
+    memcpy(AR(node).names + AR(node).namelen, name, len);
+    AR(node).names[AR(node).namelen + len] = '\0';
+    AR(node).namelen += len + 1;
+    AR(node).entries[AR(node).count++] = e;
+}
+
+/* Index a zip file from its central directory, without touching the entries */
+static int
+zipindex(Node *node) {
+    int fd = AR(node).fd, cap = 0;
+    unsigned char *buf, *p, *end, *x;
+    uint64_t total, cdsize, cdoff;
+    size_t namecap = 0, n, len;
+    struct stat st;
+    Entry e;
 
-        data = malloc(size);
-        if((read = archive_read_data(a, data, size)) != size)
-            die("Failed to read whole %ld != %ld, %s, %s, %s\n", read, size,
-                archive_entry_pathname(entry),
-                archive_error_string(a), strerror(errno));
+    if(fstat(fd, &st) == -1 || st.st_size < 22)
+        return -1;
+    len = MIN(st.st_size, 0xffff + 22);
+    buf = malloc(len);
+    if(pread(fd, buf, len, st.st_size - len) != len)
+        goto fail;
 
-        ++AR(node).idx;
-        AR(node).entry = entry;
-        images[i] = imagenode(node, archive_entry_pathname(entry), data, size);
+    for(p = buf + len - 22; p >= buf && le32(p) != 0x06054b50; p--);
+    if(p < buf)
+        goto fail;
+    total = le16(p + 10);
+    cdsize = le32(p + 12);
+    cdoff = le32(p + 16);
+    if((total == 0xffff || cdsize == 0xffffffff || cdoff == 0xffffffff) &&
+            p - buf >= 20 && le32(p - 20) == 0x07064b50) {
+        /* zip64 end of central directory record */
+        unsigned char rec[56];
+        if(pread(fd, rec, 56, le64(p - 20 + 8)) != 56 || le32(rec) != 0x06064b50)
+            goto fail;
+        total = le64(rec + 32);
+        cdsize = le64(rec + 40);
+        cdoff = le64(rec + 48);
     }
+    if(cdoff + cdsize > st.st_size)
+        goto fail;
 
-    return pagenode(node, images, i);;
+    free(buf);
+    buf = malloc(cdsize);
+    if(pread(fd, buf, cdsize, cdoff) != cdsize)
+        goto fail;
+
+    for(p = buf, end = buf + cdsize; total-- && p + 46 <= end; p += 46 + n + le16(p + 30) + le16(p + 32)) {
+        if(le32(p) != 0x02014b50)
+            goto fail;
+        n = le16(p + 28);
+        e = (Entry){
+            .method = le16(p + 10),
+            .csize = le32(p + 20),
+            .size = le32(p + 24),
+            .offset = le32(p + 42),
+        };
+        for(x = p + 46 + n; x + 4 <= p + 46 + n + le16(p + 30); x += 4 + le16(x + 2)) {
+            if(le16(x) != 0x0001)
+                continue;
+            /* zip64 extra field holds the values which overflowed, in order */
+            len = 4;
+            if(e.size == 0xffffffff)
+                e.size = le64(x + len), len += 8;
+            if(e.csize == 0xffffffff)
+                e.csize = le64(x + len), len += 8;
+            if(e.offset == 0xffffffff)
+                e.offset = le64(x + len);
+        }
+        /* skip directories and encrypted entries */
+        if((n && p[46 + n - 1] == '/') || (le16(p + 8) & 1))
+            continue;
+        addentry(node, &cap, &namecap, e, (char *)p + 46, n);
+    }
+    free(buf);
+    AR(node).kind = Zip;
+    return 0;
+
+fail:
+    free(buf);
+    free(AR(node).entries);
+    free(AR(node).names);
+    AR(node).entries = NULL;
+    AR(node).names = NULL;
+    AR(node).count = AR(node).namelen = 0;
+    return -1;
 }
 
+/* Index any other format in one pass over its headers */
 static int
-archivemoveoffset(Node *node, int offset) {
-    struct archive *a = AR(node).a;
+scanindex(Node *node) {
+    int cap = 0;
+    size_t namecap = 0;
+    const char *name;
+    struct archive *a;
     struct archive_entry *entry;
-    int advance, idx = AR(node).idx;;
 
-    if(idx == AR(node).count) {
+    if((a = openarchive(node->name)) == NULL)
+        return -1;
+
+    while(archivenextfile(a, &entry) == ARCHIVE_OK) {
+        if(!(name = archive_entry_pathname(entry)))
+            name = "";
+        addentry(node, &cap, &namecap, (Entry){
+                .offset = archive_read_header_position(a),
+                .size = archive_entry_size(entry),
+            }, name, strlen(name));
+    }
+
+    /* headers of an uncompressed tar can be read back at their offset */
+    if((archive_format(a) & ARCHIVE_FORMAT_BASE_MASK) == ARCHIVE_FORMAT_TAR &&
+            archive_filter_code(a, 0) == ARCHIVE_FILTER_NONE)
+        AR(node).kind = Tar;
+    else
+        AR(node).kind = Sequential;
+    archive_read_free(a);
+    return 0;
+}
+
+static int
+mapindex(Node *node, const char *file, const char *path, struct stat *st) {
+    int fd, writable = 1;
+    void *map;
+    struct stat cst;
+    IndexHeader *h;
+    size_t pathlen = strlen(path);
+
+    if((fd = open(file, O_RDWR)) == -1) {
+        writable = 0;
+        if((fd = open(file, O_RDONLY)) == -1)
+            return -1;
+    }
+    if(fstat(fd, &cst) == -1 || cst.st_size < sizeof(IndexHeader)) {
+        close(fd);
+        return -1;
+    }
+    /* shared, so that image sizes found later are written back */
+    map = mmap(NULL, cst.st_size, PROT_READ | PROT_WRITE,
+            writable ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return -1;
+
+    h = map;
+    if(memcmp(h->magic, INDEX_MAGIC, 8) || h->version != INDEX_VERSION ||
+            h->size != st->st_size || h->mtime != st->st_mtim.tv_sec ||
+            h->mtimensec != st->st_mtim.tv_nsec || h->pathlen != pathlen ||
+            cst.st_size != sizeof(IndexHeader) + h->count * sizeof(Entry) + pathlen + h->namelen ||
+            memcmp((char *)(h + 1) + h->count * sizeof(Entry), path, pathlen)) {
+        munmap(map, cst.st_size);
+        return -1;
+    }
+
+    AR(node).map = map;
+    AR(node).maplen = cst.st_size;
+    AR(node).kind = h->kind;
+    AR(node).count = h->count;
+    AR(node).namelen = h->namelen;
+    AR(node).entries = (Entry *)(h + 1);
+    AR(node).names = (char *)(AR(node).entries + h->count) + pathlen;
+    return 0;
+}
+
+/* Write the index next to the others and switch to the mapped copy */
+static void
+saveindex(Node *node, const char *file, const char *path, struct stat *st) {
+    int fd;
+    char *tmp, *names = AR(node).names;
+    FILE *f;
+    Entry *entries = AR(node).entries;
+    IndexHeader h = {
+        .magic = INDEX_MAGIC,
+        .version = INDEX_VERSION,
+        .kind = AR(node).kind,
+        .count = AR(node).count,
+        .pathlen = strlen(path),
+        .size = st->st_size,
+        .namelen = AR(node).namelen,
+        .mtime = st->st_mtim.tv_sec,
+        .mtimensec = st->st_mtim.tv_nsec,
+    };
+
+    /* the page index may write it at the same time as the viewer */
+    asprintf(&tmp, "%s.%ld", file, (long)syscall(SYS_gettid));
+    if((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 || !(f = fdopen(fd, "w"))) {
+        free(tmp);
+        return;
+    }
+    fwrite(&h, sizeof(h), 1, f);
+    fwrite(AR(node).entries, sizeof(Entry), h.count, f);
+    fwrite(path, 1, h.pathlen, f);
+    fwrite(AR(node).names, 1, h.namelen, f);
+    if(fclose(f) || rename(tmp, file)) {
+        unlink(tmp);
+        free(tmp);
+        return;
+    }
+    free(tmp);
+
+    if(!mapindex(node, file, path, st)) {
+        free(entries);
+        free(names);
+    }
+}
+
+static ssize_t
+readerread(struct archive *a, void *data, const void **buf) {
+    Reader *r = data;
+    ssize_t n = pread(r->fd, r->buf, sizeof(r->buf), r->offset);
+    if(n > 0)
+        r->offset += n;
+    *buf = r->buf;
+    return n;
+}
+
+/* An entry pulled block by block out of libarchive */
+typedef struct {
+    Stream s;
+    Node *node;
+    Entry *e;
+    struct archive *a;
+    Reader *r;          /* positions a, NULL when a is the shared handle */
+} ArchiveStream;
+
+static int
+archivenext(Stream *s) {
+    ArchiveStream *as = (ArchiveStream *)s;
+    const void *buf;
+    size_t len = 0;
+    la_int64_t offset;
+    int ret;
+    TRACEBEGIN(span);
+
+    do {
+        if((ret = archive_read_data_block(as->a, &buf, &len, &offset)) == ARCHIVE_EOF)
+            break;
+        if(ret != ARCHIVE_OK && ret != ARCHIVE_WARN)
+            decodeerror("Failed to read %s in %s: %s\n", AR(as->node).names + as->e->name,
+                as->node->name, archive_error_string(as->a));
+    } while(!len);
+    TRACEEND(span, "archive_read_data");
+    if(ret == ARCHIVE_EOF)
         return 0;
+    s->data = buf;
+    s->size = len;
+    return 1;
+}
+
+static void
+archiveclose(Stream *s) {
+    ArchiveStream *as = (ArchiveStream *)s;
+
+    if(as->r) {
+        archive_read_free(as->a);
+        free(as->r);
+    } else
+        pthread_mutex_unlock(&AR(as->node).lock);
+}
+
+/* Start reading an entry with libarchive, right at its header */
+static void
+openpositioned(ArchiveStream *as) {
+    struct archive_entry *entry;
+
+    as->a = archive_read_new();
+    as->r = malloc(sizeof(Reader));
+    *as->r = (Reader){ .fd = AR(as->node).fd, .offset = as->e->offset };
+    if(AR(as->node).kind == Zip)
+        archive_read_support_format_zip_streamable(as->a);
+    else
+        archive_read_support_format_tar(as->a);
+    if(archive_read_open(as->a, as->r, NULL, readerread, NULL) != ARCHIVE_OK ||
+            archivenextfile(as->a, &entry) != ARCHIVE_OK)
+        die("Failed to read %s in %s: %s\n", AR(as->node).names + as->e->name,
+            as->node->name, archive_error_string(as->a));
+}
+
+/* Walk the shared handle, which only moves forward. It stays locked until
+ * the stream is closed. */
+static void
+opensequential(ArchiveStream *as, int idx) {
+    struct archive_entry *entry;
+    Node *node = as->node;
+
+    pthread_mutex_lock(&AR(node).lock);
+    if(!AR(node).a || idx < AR(node).pos) {
+        if(AR(node).a)
+            archive_read_free(AR(node).a);
+        if(!(AR(node).a = openarchive(node->name)))
+            die("Failed to reopen archive: %s\n", node->name);
+        AR(node).pos = 0;
     }
 
-    offset -= imageperpage;
-    if(offset > 0) {
-        advance = MIN(offset, AR(node).count - idx);
-        while(advance > 0) {
-            if(archive_read_next_header(a, &entry) != ARCHIVE_OK)
-                die("Failed to seek archive");
-            --advance; ++idx;
-        }
-    } else {
-        archive_read_free(a);
-        // should not fail
-        a = openarchive(node->name);
+    for(; AR(node).pos <= idx; ++AR(node).pos)
+        if(archivenextfile(AR(node).a, &entry) != ARCHIVE_OK)
+            die("Failed to seek archive: %s\n", archive_error_string(AR(node).a));
+    as->a = AR(node).a;
+}
 
-        advance = idx + offset;
-        idx = 0;
-        while(advance > 0) {
-            if(archive_read_next_header(a, &entry) != ARCHIVE_OK)
-                die("Failed to seek archive");
-            --advance; ++idx;
-        }
-        AR(node).a = a;
+/* Stored zip data follows the local header, in the map when there is one */
+static char *
+readstored(Node *node, Entry *e) {
+    unsigned char local[30], *p = local;
+    uint64_t offset;
+    char *data;
+
+    if(AR(node).file && e->offset + 30 <= AR(node).filelen)
+        p = (unsigned char *)AR(node).file + e->offset;
+    else if(pread(AR(node).fd, local, 30, e->offset) != 30)
+        return NULL;
+    if(le32(p) != 0x04034b50)
+        return NULL;
+    offset = e->offset + 30 + le16(p + 26) + le16(p + 28);
+
+    if(AR(node).file)
+        return offset + e->size <= AR(node).filelen ? AR(node).file + offset : NULL;
+    data = poolget(e->size);
+    if(pread(AR(node).fd, data, e->size, offset) != e->size) {
+        poolput(data);
+        return NULL;
+    }
+    return data;
+}
+
+/* Stored zip entries are read whole, others are streamed out of libarchive
+ * so that decoding starts with the first block */
+static Stream *
+archiveopenentry(Node *node, int idx, char **name) {
+    Entry *e = &AR(node).entries[idx];
+    ArchiveStream *as;
+    Stream *s;
+    char *data;
+
+    *name = strdup(AR(node).names + e->name);
+    if(AR(node).kind == Zip && e->method == 0) {
+        if(!(data = readstored(node, e)))
+            die("Failed to read %s in %s\n", *name, node->name);
+        s = memstream(data, e->size, AR(node).file ? NULL : data);
+    } else {
+        as = calloc(1, sizeof(ArchiveStream));
+        as->node = node;
+        as->e = e;
+        as->s.next = archivenext;
+        as->s.close = archiveclose;
+        if(AR(node).kind == Sequential)
+            opensequential(as, idx);
+        else
+            openpositioned(as);
+        s = &as->s;
+        s->next(s);
     }
-    AR(node).idx = idx;
-    AR(node).entry = entry;
 
-    return offset;
+    return s;
+}
+
+static Node*
+archiveloadnext(Node *node) {
+    int i;
+    Node **images = malloc(sizeof(Node *) * imageperpage);
+
+    for(i = 0; i < imageperpage && AR(node).idx < AR(node).count; i++)
+        images[i] = loadimage(node, AR(node).idx++);
+
+    return pagenode(node, images, i);
+}
+
+static int
+archivemoveoffset(Node *node, int offset) {
+    AR(node).idx = MAX(MIN(AR(node).idx + offset - imageperpage, AR(node).count - 1), 0);
+    return 0;
 }
 
 static char *
 archivegentitle(Node *node, char *parenttitle) {
     char *title;
-    asprintf(&title, "%s %s [%d/%d] |", parenttitle, node->name, AR(node).idx + 1, AR(node).count);
+    asprintf(&title, "%s %s [%d/%d] |", parenttitle, node->name, shownentry(node), AR(node).count);
     return title;
 }
 
 static void
 archivecleanup(Node *node) {
-    archive_read_free(AR(node).a);
+    if(AR(node).a)
+        archive_read_free(AR(node).a);
+    close(AR(node).fd);
+    if(AR(node).file)
+        munmap(AR(node).file, AR(node).filelen);
+    if(AR(node).map)
+        munmap(AR(node).map, AR(node).maplen);
+    else {
+        free(AR(node).entries);
+        free(AR(node).names);
+    }
+    pthread_mutex_destroy(&AR(node).lock);
 }
 
 Node *
 archivenode(Node * parent, const char *filename) {
     Node *node;
-    int count = 0;
-    struct archive *a;
-    struct archive_entry *entry;
+    int fd;
+    char *path, *file;
+    void *map;
+    struct stat st;
 
-    if((a = openarchive(filename)) == NULL)
+    if((fd = open(filename, O_RDONLY)) == -1)
+        return NULL;
+    if(fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(fd);
         return NULL;
-
-    while(archive_read_next_header(a, &entry) == ARCHIVE_OK) {
-        archive_read_data_skip(a);
-        ++count;
     }
-    archive_read_free(a);
 
     node = malloc(sizeof(Node));
     *node = (Node){
@@ -272,11 +819,40 @@ archivenode(Node * parent, const char *filename) {
         .moveoffset = archivemoveoffset,
         .gentitle = archivegentitle,
         .cleanup = archivecleanup,
+        .openentry = archiveopenentry,
         .u = { .archive = {
-            .a = openarchive(filename),
+            .fd = fd,
+            .pos = 0,
             .idx = 0,
-            .count = count,
+            .count = 0,
         }}};
+
+    if(!(path = realpath(filename, NULL)))
+        path = strdup(filename);
+    file = cachepath(keyhash(KEYHASH, path), ".idx");
+    if(!file || mapindex(node, file, path, &st)) {
+        if(zipindex(node) && scanindex(node)) {
+            close(fd);
+            free(node->name);
+            free(node);
+            free(path);
+            free(file);
+            return NULL;
+        }
+        if(file)
+            saveindex(node, file, path, &st);
+    }
+    free(path);
+    free(file);
+
+    if(AR(node).kind == Zip && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(map != MAP_FAILED) {
+            AR(node).file = map;
+            AR(node).filelen = st.st_size;
+        }
+    }
+    pthread_mutex_init(&AR(node).lock, NULL);
     return node;
 }
 #endif
@@ -298,191 +874,2363 @@ die(const char *errstr, ...) {
     exit(EXIT_FAILURE);
 }
 
+/* An error in the data of a page, fatal unless pages are skipped */
+void
+decodeerror(const char *errstr, ...) {
+    va_list ap;
+    va_start(ap, errstr);
+    vfprintf(stderr, errstr, ap);
+    va_end(ap);
+    if(decodefail)
+        longjmp(*decodefail, 1);
+    exit(EXIT_FAILURE);
+}
+
 void
 jpegerrorexit (j_common_ptr cinfo) {
     cinfo->err->output_message (cinfo);
-    die("Error on jpeg");
+    if(decodefail)
+        jpeg_destroy(cinfo);
+    decodeerror("Error on jpeg\n");
 }
 
-/*This returns an array for a 24 bit image.*/
-void
-decodejpeg (void *buf, size_t size, Node *nodeout) {
-    JSAMPARRAY linebuf;
-    struct jpeg_decompress_struct cinfo;
-    struct jpeg_error_mgr err_mgr;
-    vec2 imgsize;
-    int x = 0, y, bytesperpixel, lineoffset;
-    unsigned char *decodebuf, *base;
+/* Smallest DCT scaling, in eighths, which still covers fit */
+int
+dctscale(vec2 full, vec2 fit) {
+    int scale;
+    double r;
 
-    cinfo.err = jpeg_std_error (&err_mgr);
-    err_mgr.error_exit = jpegerrorexit;
+    if(fit.x <= 0 || fit.y <= 0)
+        return 8;
+    r = 8 * MIN((double)fit.x / full.x, (double)fit.y / full.y);
+    scale = r;
+    if(scale < r)
+        ++scale;
+    return MAX(MIN(scale, 8), 1);
+}
 
-    jpeg_create_decompress (&cinfo);
-    jpeg_mem_src (&cinfo, buf, size);
-    jpeg_read_header (&cinfo, 1);
-    jpeg_start_decompress (&cinfo);
+/* libjpeg source pulling the blocks of a Stream */
+typedef struct {
+    struct jpeg_source_mgr pub;
+    Stream *s;
+} Source;
 
-    imgsize = (vec2){.x = cinfo.output_width, .y = cinfo.output_height};
-    bytesperpixel = cinfo.output_components;
+static void
+srcinit(j_decompress_ptr cinfo) {
+}
 
-    linebuf = cinfo.mem->alloc_sarray ((j_common_ptr) &cinfo, JPOOL_IMAGE, (imgsize.x * bytesperpixel), 1);
-    if(!(decodebuf = malloc(3 * (imgsize.x * imgsize.y) + 1)))
-        die("Failed to allocate memory on JPEG decoding");
+static boolean
+srcfill(j_decompress_ptr cinfo) {
+    static const JOCTET eoi[] = { 0xff, JPEG_EOI };
+    Source *src = (Source *)cinfo->src;
 
-    base = decodebuf;
-    lineoffset = (imgsize.x * 3);
-    for (y = 0; y < imgsize.y; ++y) {
-        jpeg_read_scanlines (&cinfo, linebuf, 1);
-        if (3 == bytesperpixel) {
-            memcpy(base, *linebuf, lineoffset);
-            base += lineoffset;
-        } else if (1 == bytesperpixel) {
-            for (x = 0; x < imgsize.x; ++x) {
-                memset(base, linebuf[0][x], 3);
-                base += 3;
-            }
-        } else {
-            die("The number of color channels is %d."
-                "This program only handles 1 or 3\n", bytesperpixel);
-        }
+    if(src->s->next && src->s->next(src->s)) {
+        src->pub.next_input_byte = src->s->data;
+        src->pub.bytes_in_buffer = src->s->size;
+    } else {
+        /* end a truncated entry like jpeg_mem_src does */
+        WARNMS(cinfo, JWRN_JPEG_EOF);
+        src->pub.next_input_byte = eoi;
+        src->pub.bytes_in_buffer = 2;
     }
+    return TRUE;
+}
 
-    jpeg_finish_decompress (&cinfo);
-    jpeg_destroy_decompress (&cinfo);
+static void
+srcskip(j_decompress_ptr cinfo, long n) {
+    struct jpeg_source_mgr *src = cinfo->src;
 
-    IMG(nodeout).imagebuf = decodebuf;
-    IMG(nodeout).size = imgsize;
+    while(n > (long)src->bytes_in_buffer) {
+        n -= src->bytes_in_buffer;
+        srcfill(cinfo);
+    }
+    if(n > 0) {
+        src->next_input_byte += n;
+        src->bytes_in_buffer -= n;
+    }
 }
 
-char *
-readfile(const char *filename, size_t *size) {
-    int fd;
-    char *buf;
-    struct stat stat;
-
-    fd = open(filename, O_RDONLY);
-    fstat(fd, &stat);
+static void
+srcterm(j_decompress_ptr cinfo) {
+}
 
-    buf = malloc(stat.st_size);
-    if((*size = read(fd, buf, stat.st_size)) != stat.st_size)
-        die("Failed to read whole: %lu != %lu", *size, stat.st_size);
+/* Whether the page decoded from s is not needed anymore */
+static int
+cancelled(Stream *s) {
+    return s->cancel && __atomic_load_n(s->cancel, __ATOMIC_RELAXED);
+}
 
-    return buf;
+static void
+jpegstream(j_decompress_ptr cinfo, Source *src, Stream *s) {
+    *src = (Source){
+        .pub = {
+            .next_input_byte = s->data,
+            .bytes_in_buffer = s->size,
+            .init_source = srcinit,
+            .fill_input_buffer = srcfill,
+            .skip_input_data = srcskip,
+            .resync_to_restart = jpeg_resync_to_restart,
+            .term_source = srcterm,
+        },
+        .s = s,
+    };
+    cinfo->src = &src->pub;
 }
 
-Node *
-pagenode(Node * parent, Node **images, int count) {
-    char *name= strdup("page"), *out;
-    int i;
-    for(i = 0; i < count; i++) {
-        asprintf(&out, "%s,%s", name, images[i]->name);
-        free(name);
-        name = out;
+/* Reads rows scanlines into dst as pixels of pixelsize bytes, returns 0 when
+ * the decode of s got cancelled first */
+static int
+readlines(j_decompress_ptr cinfo, Stream *s, unsigned char *dst, int pixelsize, int rows) {
+    JSAMPROW row;
+    int y, width = cinfo->output_width, bytesperpixel = cinfo->output_components;
+
+    if (pixelsize == bytesperpixel) {
+        for (y = 0; y < rows && !cancelled(s); ++y) {
+            row = dst + (size_t)y * width * pixelsize;
+            jpeg_read_scanlines (cinfo, &row, 1);
+        }
+    } else {
+        die("The number of color channels is %d."
+            "This program only handles 1 or 3\n", bytesperpixel);
     }
-    Node *newnode =malloc(sizeof(Node));
-    *newnode = (Node) {
-        .parent = parent, .type = Page, .name = name,
-        .u = { .page = {
-               .count = count,
-               .images = images,
-        }}};
-    return newnode;
+    return y == rows;
 }
 
-Node *
-imagenode(Node * parent, const char *name, char *data, size_t size) {
-    //TODO: proper error handling
-    Node *newnode = malloc(sizeof(Node));
-    *newnode = (Node){ .type = Image,
-                       .name = strdup(name),
-                       .parent = parent };
-    decodejpeg(data, size, newnode);
-    free(data);
-    return newnode;
-}
+/* MCU rows of a baseline JPEG between two restart markers, decoded as a JPEG
+ * of their own: the header with its height patched, their entropy coded
+ * data and an EOI. Of the rows decoded, skip come before the band's own */
+typedef struct {
+    Stream s;
+    const unsigned char *data;
+    size_t len;
+    int part, row, rows, skip, height;
+    unsigned char *dst;
+    int scale, pixelsize;
+    J_COLOR_SPACE space;
+    pthread_t thread;
+    int threaded, done;
+} Band;
 
-void
-loadnext(void) {
-    char *filename, *data;
-    int i;
-    size_t size;
-    struct Node *node, *newnode;
+/* where the entropy coded data may be split */
+typedef struct {
+    const unsigned char *p;     /* after an RST marker */
+    int row;
+} Restart;
 
-    node = curnode;
-    switch(node->type) {
-    case Image:
-    case Page:
-        moveoffset(imageperpage);
-        return;
+static int
+bandnext(Stream *s) {
+    static const unsigned char eoi[] = { 0xff, JPEG_EOI };
+    Band *b = (Band *)s;
 
-    case FileList:
-        filename = FL(node).filenames[FL(node).idx];
+    switch(b->part++) {
+    case 0:
+        s->data = b->data;
+        s->size = b->len;
+        return 1;
+    case 1:
+        s->data = eoi;
+        s->size = sizeof(eoi);
+        return 1;
+    }
+    return 0;
+}
 
-        //TODO: should detect filetype
+static void *
+decodeband(void *arg) {
+    Band *b = arg;
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr err_mgr;
+    JSAMPARRAY scratch;
+    Source src;
+    jmp_buf fail, *outer = decodefail;
+    int y;
+    TRACEBEGIN(span);
+
+    /* a bad band is not done, so that its page is skipped after the
+     * other bands */
+    decodefail = skipbad ? &fail : NULL;
+    if(setjmp(fail)) {
+        decodefail = outer;
+        return NULL;
+    }
+    cinfo.err = jpeg_std_error (&err_mgr);
+    err_mgr.error_exit = jpegerrorexit;
+    jpeg_create_decompress (&cinfo);
+    jpegstream(&cinfo, &src, &b->s);
+    jpeg_read_header (&cinfo, 1);
+    cinfo.scale_num = b->scale;
+    cinfo.scale_denom = 8;
+    cinfo.out_color_space = b->space;
+    jpeg_start_decompress (&cinfo);
+    if(b->skip) {
+        scratch = cinfo.mem->alloc_sarray ((j_common_ptr) &cinfo, JPOOL_IMAGE,
+                cinfo.output_width * cinfo.output_components, 1);
+        for(y = 0; y < b->skip; y++)
+            jpeg_read_scanlines (&cinfo, scratch, 1);
+    }
+    b->done = readlines(&cinfo, &b->s, b->dst, b->pixelsize, MIN(b->rows, (int)cinfo.output_height - b->skip));
+    jpeg_destroy_decompress (&cinfo);
+    decodefail = outer;
+    TRACEEND(span, "decodeband");
+    return NULL;
+}
+
+/* Splits a baseline JPEG with restart markers into at most n bands of whole
+ * MCU rows, returns how many it found */
+static int
+jpegbands(j_decompress_ptr cinfo, Stream *s, Band *bands, int n) {
+    const unsigned char *data = s->data, *p = data + 2, *end = data + s->size, *q;
+    size_t len, sof = 0, hdrlen, restarts = 0;
+    int i, j, k, marker = 0, mcuw, mcuh, mcusperrow, rows, row, overlap, count = 0;
+    int nr = 0, rsize = 64, *first;
+    Restart *r;
+
+    if(cinfo->progressive_mode || jpeg_has_multiple_scans(cinfo) || !cinfo->restart_interval)
+        return 0;
+    /* the header runs through the SOS segment */
+    while(marker != 0xda && p + 4 <= end) {
+        if(p[0] != 0xff)
+            return 0;
+        if((marker = p[1]) == 0xff) {
+            p++;
+            continue;
+        }
+        len = p[2] << 8 | p[3];
+        if(marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc)
+            sof = p - data;
+        p += 2 + len;
+    }
+    if(marker != 0xda || !sof || p >= end)
+        return 0;
+    hdrlen = p - data;
+
+    mcuw = mcuh = DCTSIZE;
+    if(cinfo->comps_in_scan > 1) {
+        mcuw *= cinfo->max_h_samp_factor;
+        mcuh *= cinfo->max_v_samp_factor;
+    }
+    mcusperrow = (cinfo->image_width + mcuw - 1) / mcuw;
+    rows = (cinfo->image_height + mcuh - 1) / mcuh;
+    /* upsampled chroma needs the rows next to a band, those are decoded
+     * again from the restarts before and after it */
+    overlap = cinfo->max_v_samp_factor > 1;
+
+    /* the data splits after markers which end an MCU row and, as libjpeg
+     * expects RST0 first, are themselves RST7 */
+    if(!(r = malloc(rsize * sizeof(Restart))) || !(first = malloc(n * sizeof(int))))
+        die("Failed to allocate memory on JPEG decoding");
+    r[nr++] = (Restart){ .p = p, .row = 0 };
+    for(q = p; q < end && (q = memchr(q, 0xff, end - q)) && q + 1 < end; q++) {
+        if(q[1] < JPEG_RST0 || q[1] > JPEG_RST0 + 7) {
+            if(q[1] == 0 || q[1] == 0xff)
+                continue;
+            break;
+        }
+        restarts++;
+        q++;
+        if(restarts % 8 || restarts * cinfo->restart_interval % mcusperrow)
+            continue;
+        if((row = restarts * cinfo->restart_interval / mcusperrow) >= rows)
+            break;
+        if(nr == rsize && !(r = realloc(r, (rsize *= 2) * sizeof(Restart))))
+            die("Failed to allocate memory on JPEG decoding");
+        r[nr++] = (Restart){ .p = q + 1, .row = row };
+    }
+
+    for(i = 0; i < nr && count < n; i++)
+        if(r[i].row >= rows * count / n)
+            first[count++] = i;
+    for(i = 0; i < count && count > 1; i++) {
+        /* the restarts at which the decoding starts and stops, nr at the end */
+        j = first[i] - (overlap && i > 0);
+        k = i == count - 1 ? nr : MIN(first[i + 1] + overlap, nr);
+        bands[i] = (Band){
+            .data = r[j].p,
+            .len = (k < nr ? r[k].p - 2 : end) - r[j].p,
+            .row = r[first[i]].row * mcuh,
+            .skip = (r[first[i]].row - r[j].row) * mcuh,
+            .height = (k < nr ? r[k].row * mcuh : (int)cinfo->image_height) - r[j].row * mcuh,
+        };
+    }
+    free(r);
+    free(first);
+    if(count < 2)
+        return 0;
+
+    for(i = 0; i < count; i++) {
+        if(!(bands[i].s.buf = poolget(hdrlen)))
+            die("Failed to allocate memory on JPEG decoding");
+        memcpy(bands[i].s.buf, data, hdrlen);
+        ((unsigned char *)bands[i].s.buf)[sof + 5] = bands[i].height >> 8;
+        ((unsigned char *)bands[i].s.buf)[sof + 6] = bands[i].height & 0xff;
+        bands[i].s.data = bands[i].s.buf;
+        bands[i].s.size = hdrlen;
+        bands[i].s.next = bandnext;
+        bands[i].s.cancel = s->cancel;
+    }
+    return count;
+}
+
+/* Decodes the bands into their rows of dst, the first one on this thread.
+ * Returns 0 when cancelled. */
+static int
+decodebands(j_decompress_ptr cinfo, Band *bands, int count, unsigned char *dst, int pixelsize) {
+    size_t stride = (size_t)cinfo->output_width * pixelsize;
+    int i, y, done = 1;
+
+    for(i = count - 1; i >= 0; i--) {
+        /* whole MCU rows scale exactly, the last band takes the rest */
+        y = bands[i].row * cinfo->scale_num / cinfo->scale_denom;
+        bands[i].rows = i == count - 1 ? (int)cinfo->output_height - y :
+            bands[i + 1].row * cinfo->scale_num / cinfo->scale_denom - y;
+        bands[i].dst = dst + y * stride;
+        bands[i].skip = bands[i].skip * cinfo->scale_num / cinfo->scale_denom;
+        bands[i].scale = cinfo->scale_num;
+        bands[i].pixelsize = pixelsize;
+        bands[i].space = cinfo->out_color_space;
+        bands[i].threaded = i && !pthread_create(&bands[i].thread, NULL, decodeband, &bands[i]);
+        if(!bands[i].threaded)
+            decodeband(&bands[i]);
+    }
+    for(i = 0; i < count; i++) {
+        if(bands[i].threaded)
+            pthread_join(bands[i].thread, NULL);
+        done &= bands[i].done;
+        poolput(bands[i].s.buf);
+    }
+    return done;
+}
+
+/*This returns an array of IMG(nodeout).format pixels, decoded just large enough to fit,
+ or as a quick eighth scale preview.*/
+void
+decodejpeg (Stream *s, Node *nodeout, vec2 fit, int preview) {
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr err_mgr;
+    Source src;
+    Band *bands = NULL;
+    vec2 imgsize;
+    int nbands = 0, threads, pixelsize, done;
+    unsigned char *decodebuf;
+    TRACEBEGIN(span);
+
+    cinfo.err = jpeg_std_error (&err_mgr);
+    err_mgr.error_exit = jpegerrorexit;
+
+    jpeg_create_decompress (&cinfo);
+    jpegstream(&cinfo, &src, s);
+    jpeg_read_header (&cinfo, 1);
+
+    IMG(nodeout).full = (vec2){.x = cinfo.image_width, .y = cinfo.image_height};
+    IMG(nodeout).scale = preview ? 1 : dctscale(IMG(nodeout).full, fit);
+    if(preview) {
+        /* eighth scale needs only the DC coefficients */
+        cinfo.dct_method = JDCT_IFAST;
+        cinfo.do_fancy_upsampling = FALSE;
+        /* and of a progressive JPEG, only its first scan is read */
+        cinfo.buffered_image = jpeg_has_multiple_scans(&cinfo);
+    }
+    cinfo.scale_num = IMG(nodeout).scale;
+    cinfo.scale_denom = 8;
+    IMG(nodeout).format = RGB24;
+#ifdef JCS_EXTENSIONS
+    /* libjpeg-turbo writes the pixel layout of the frame */
+    IMG(nodeout).format = pixelformat;
+    cinfo.out_color_space = pixelformat == XRGB32 ? JCS_EXT_XRGB : JCS_EXT_BGRX;
+#endif
+    /* gray pages stay a byte per pixel, scaling spreads them to the frame */
+    if(cinfo.jpeg_color_space == JCS_GRAYSCALE) {
+        IMG(nodeout).format = GRAY8;
+        cinfo.out_color_space = JCS_GRAYSCALE;
+    }
+
+    /* huge pages in memory are split at their restart markers */
+    threads = DECODE_THREADS ? DECODE_THREADS : sysconf(_SC_NPROCESSORS_ONLN);
+    if(!preview && !s->next && threads > 1 &&
+            (double)cinfo.image_width * cinfo.image_height >= DECODE_BANDS_PIXELS) {
+        if(!(bands = malloc(threads * sizeof(Band))))
+            die("Failed to allocate memory on JPEG decoding");
+        nbands = jpegbands(&cinfo, s, bands, threads);
+    }
+    if(nbands)
+        jpeg_calc_output_dimensions (&cinfo);
+    else {
+        jpeg_start_decompress (&cinfo);
+        if(cinfo.buffered_image)
+            jpeg_start_output (&cinfo, 1);
+    }
+
+    imgsize = (vec2){.x = cinfo.output_width, .y = cinfo.output_height};
+    pixelsize = PIXELSIZE(IMG(nodeout).format);
+
+    if(!(decodebuf = poolget((size_t)pixelsize * imgsize.x * imgsize.y)))
+        die("Failed to allocate memory on JPEG decoding");
+    /* given back by imagenode() when the decode fails */
+    IMG(nodeout).imagebuf = decodebuf;
+
+    if(nbands)
+        done = decodebands(&cinfo, bands, nbands, decodebuf, pixelsize);
+    else
+        done = readlines(&cinfo, s, decodebuf, pixelsize, imgsize.y);
+    free(bands);
+
+    /* the remaining scans of a preview are dropped with the decompressor */
+    if(!nbands && !cinfo.buffered_image && done)
+        jpeg_finish_decompress (&cinfo);
+    jpeg_destroy_decompress (&cinfo);
+    if(!done) {
+        poolput(decodebuf);
+        decodebuf = NULL;
+    }
+
+    IMG(nodeout).imagebuf = decodebuf;
+    IMG(nodeout).size = imgsize;
+    TRACEEND(span, preview ? "decodejpeg preview" : "decodejpeg");
+}
+
+#ifdef PNG
+static void
+pngerror(png_structp png, png_const_charp msg) {
+    png_infop info = png_get_error_ptr(png);
+
+    if(decodefail)
+        png_destroy_read_struct(&png, &info, NULL);
+    decodeerror("Error on png: %s\n", msg);
+}
+
+/* libpng pulls the stream through this */
+static void
+pngread(png_structp png, png_bytep out, png_size_t len) {
+    Stream *s = png_get_io_ptr(png);
+    size_t n;
+
+    while(len) {
+        while(!s->size)
+            if(!s->next || !s->next(s))
+                png_error(png, "truncated image");
+        n = MIN(len, s->size);
+        memcpy(out, s->data, n);
+        s->data += n;
+        s->size -= n;
+        out += n;
+        len -= n;
+    }
+}
+
+/* PNG has no scaled decoding, pages always come at full size */
+void
+decodepng(Stream *s, Node *nodeout, vec2 fit, int preview) {
+    png_structp png;
+    png_infop info;
+    png_color_16 black = { 0 };
+    unsigned char *decodebuf;
+    vec2 size;
+    int y = 0, pass, passes, format, pixelsize;
+    TRACEBEGIN(span);
+
+    if(!(png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, pngerror, NULL)) ||
+            !(info = png_create_info_struct(png)))
+        die("Failed to create png decoder\n");
+    /* pngerror() frees both on a skipped page */
+    png_set_error_fn(png, info, pngerror, NULL);
+    png_set_read_fn(png, s, pngread);
+    png_read_info(png, info);
+    size = (vec2){ .x = png_get_image_width(png, info), .y = png_get_image_height(png, info) };
+
+    /* 8 bit gray, or RGB of the frame layout, transparency over black */
+    format = png_get_color_type(png, info) & PNG_COLOR_MASK_COLOR ? pixelformat : GRAY8;
+    pixelsize = PIXELSIZE(format);
+    png_set_expand(png);
+    png_set_strip_16(png);
+    if(png_get_valid(png, info, PNG_INFO_tRNS) || png_get_color_type(png, info) & PNG_COLOR_MASK_ALPHA)
+        png_set_background(png, &black, PNG_BACKGROUND_GAMMA_SCREEN, 0, 1.0);
+    if(format == XRGB32)
+        png_set_filler(png, 0xff, PNG_FILLER_BEFORE);
+    else if(format == BGRX32) {
+        png_set_bgr(png);
+        png_set_filler(png, 0xff, PNG_FILLER_AFTER);
+    }
+    passes = png_set_interlace_handling(png);
+    png_read_update_info(png, info);
+    if(png_get_rowbytes(png, info) != (size_t)size.x * pixelsize)
+        die("Unexpected png row size\n");
+
+    if(!(decodebuf = poolget((size_t)size.x * size.y * pixelsize)))
+        die("Failed to allocate memory on PNG decoding");
+    /* given back by imagenode() when the decode fails */
+    IMG(nodeout).imagebuf = decodebuf;
+    for(pass = 0; pass < passes && !cancelled(s); pass++)
+        for(y = 0; y < size.y && !cancelled(s); y++)
+            png_read_row(png, decodebuf + (size_t)y * size.x * pixelsize, NULL);
+    png_destroy_read_struct(&png, &info, NULL);
+    if(pass < passes || y < size.y) {
+        poolput(decodebuf);
+        decodebuf = NULL;
+    }
+
+    IMG(nodeout).imagebuf = decodebuf;
+    IMG(nodeout).format = format;
+    IMG(nodeout).size = IMG(nodeout).full = size;
+    IMG(nodeout).scale = 8;
+    TRACEEND(span, "decodepng");
+}
+#endif
+
+#ifdef WEBP
+/* WebP scales while decoding to any size, it is done in eighths like JPEG
+ * so that the cache compares both alike */
+void
+decodewebp(Stream *s, Node *nodeout, vec2 fit, int preview) {
+    WebPDecoderConfig config;
+    WebPIDecoder *idec;
+    VP8StatusCode status;
+    unsigned char *decodebuf;
+    vec2 size;
+    TRACEBEGIN(span);
+
+    if(!WebPInitDecoderConfig(&config) ||
+            WebPGetFeatures(s->data, s->size, &config.input) != VP8_STATUS_OK)
+        decodeerror("Error on webp header\n");
+    IMG(nodeout).full = (vec2){ .x = config.input.width, .y = config.input.height };
+    IMG(nodeout).scale = preview ? 1 : dctscale(IMG(nodeout).full, fit);
+    size.x = MAX((IMG(nodeout).full.x * IMG(nodeout).scale + 7) / 8, 1);
+    size.y = MAX((IMG(nodeout).full.y * IMG(nodeout).scale + 7) / 8, 1);
+    if(IMG(nodeout).scale < 8) {
+        config.options.use_scaling = 1;
+        config.options.scaled_width = size.x;
+        config.options.scaled_height = size.y;
+    }
+    if(preview) {
+        config.options.bypass_filtering = 1;
+        config.options.no_fancy_upsampling = 1;
+    }
+
+    /* premultiplied, that is transparency over black */
+    if(!(decodebuf = poolget((size_t)size.x * size.y * 4)))
+        die("Failed to allocate memory on WebP decoding");
+    /* given back by imagenode() when the decode fails */
+    IMG(nodeout).imagebuf = decodebuf;
+    memset(decodebuf, 0, (size_t)size.x * size.y * 4);
+    config.output.colorspace = pixelformat == XRGB32 ? MODE_Argb : MODE_bgrA;
+    config.output.is_external_memory = 1;
+    config.output.u.RGBA.rgba = decodebuf;
+    config.output.u.RGBA.stride = size.x * 4;
+    config.output.u.RGBA.size = (size_t)size.x * size.y * 4;
+
+    /* fed block by block as the stream comes, a truncated one shows what came */
+    if(!(idec = WebPIDecode(NULL, 0, &config)))
+        die("Failed to create webp decoder\n");
+    while((status = WebPIAppend(idec, s->data, s->size)) == VP8_STATUS_SUSPENDED)
+        if(cancelled(s) || !s->next || !s->next(s))
+            break;
+    WebPIDelete(idec);
+    if(status != VP8_STATUS_OK && status != VP8_STATUS_SUSPENDED)
+        decodeerror("Error on webp: %d\n", status);
+    if(cancelled(s)) {
+        poolput(decodebuf);
+        decodebuf = NULL;
+    }
+
+    IMG(nodeout).imagebuf = decodebuf;
+    IMG(nodeout).format = pixelformat;
+    IMG(nodeout).size = size;
+    TRACEEND(span, "decodewebp");
+}
+#endif
+
+/* What a file is, from its first SNIFF_SIZE bytes */
+int
+sniff(const unsigned char *p, size_t n) {
+    if(n >= 3 && p[0] == 0xff && p[1] == 0xd8 && p[2] == 0xff)
+        return FileJPEG;
+    if(n >= 8 && !memcmp(p, "\x89PNG\r\n\x1a\n", 8))
+        return FilePNG;
+    if(n >= 12 && !memcmp(p, "RIFF", 4) && !memcmp(p + 8, "WEBP", 4))
+        return FileWebP;
+    if((n >= 4 && (!memcmp(p, "PK\3\4", 4) || !memcmp(p, "PK\5\6", 4))) ||
+            (n >= 6 && !memcmp(p, "Rar!\x1a\x07", 6)) ||
+            (n >= 6 && !memcmp(p, "7z\xbc\xaf\x27\x1c", 6)) ||
+            (n >= 2 && p[0] == 0x1f && p[1] == 0x8b) ||             /* gzip */
+            (n >= 3 && !memcmp(p, "BZh", 3)) ||
+            (n >= 6 && !memcmp(p, "\xfd" "7zXZ", 6)) ||
+            (n >= 4 && !memcmp(p, "\x28\xb5\x2f\xfd", 4)) ||        /* zstd */
+            (n >= 262 && !memcmp(p + 257, "ustar", 5)))
+        return FileArchive;
+    return FileUnknown;
+}
+
+static int
+sniffile(const char *filename) {
+    int fd;
+    ssize_t n;
+    unsigned char magic[SNIFF_SIZE];
+
+    if((fd = open(filename, O_RDONLY)) == -1)
+        return FileUnknown;
+    n = read(fd, magic, sizeof(magic));
+    close(fd);
+    return n > 0 ? sniff(magic, n) : FileUnknown;
+}
+
+#ifdef ARCHIVE
+/* The archive a file is by its first bytes, and *type what they say. Files
+ * of no type sniff() knows are tried as archives in a second step, as
+ * libarchive reads more formats than it names, such as cpio or iso9660.
+ * NULL for images and for files libarchive cannot read. */
+static Node *
+sniffarchive(Node *parent, const char *path, int *type) {
+    *type = sniffile(path);
+    if(*type != FileArchive && *type != FileUnknown)
+        return NULL;
+    return archivenode(parent, path);
+}
+#endif
+
+/* Decoders by the file type they read. They write IMG(nodeout).format
+ * pixels at scale/8 of the original size: the smallest covering fit, or a
+ * quick preview, when they can scale, the full size otherwise. Those
+ * without a preview are not asked for one. */
+static const struct {
+    int type;
+    void (*decode)(Stream *s, Node *nodeout, vec2 fit, int preview);
+    int preview;
+} decoders[] = {
+    { FileJPEG, decodejpeg, 1 },
+#ifdef PNG
+    { FilePNG,  decodepng,  0 },
+#endif
+#ifdef WEBP
+    { FileWebP, decodewebp, 1 },
+#endif
+};
+
+static int
+decoder(int type) {
+    int i;
+
+    for(i = 0; i < LENGTH(decoders); i++)
+        if(decoders[i].type == type)
+            return i;
+    return -1;
+}
+
+char *
+readfile(const char *filename, size_t *size) {
+    int fd;
+    char *buf;
+    struct stat stat;
+
+    if((fd = open(filename, O_RDONLY)) == -1)
+        return NULL;
+    fstat(fd, &stat);
+
+    buf = poolget(stat.st_size);
+    if((*size = read(fd, buf, stat.st_size)) != stat.st_size)
+        die("Failed to read whole: %lu != %lu", *size, stat.st_size);
+    close(fd);
+
+    return buf;
+}
+
+/* A stream of size bytes at data, giving buf back on close */
+Stream *
+memstream(const void *data, size_t size, void *buf) {
+    Stream *s = malloc(sizeof(Stream));
+    *s = (Stream){ .data = data, .size = size, .buf = buf };
+    return s;
+}
+
+Stream *
+openentry(Node *container, int idx, char **name) {
+    char *data;
+    const char *file;
+    size_t size;
+    Stream *s = NULL;
+    TRACEBEGIN(span);
+
+    if(container->openentry)
+        s = container->openentry(container, idx, name);
+    /* a Directory publishes longer listings while workers read */
+    else if((file = __atomic_load_n(&FL(container).filenames, __ATOMIC_ACQUIRE)[idx]) &&
+            (data = readfile(file, &size))) {
+        *name = strdup(file);
+        s = memstream(data, size, data);
+    }
+    TRACEEND(span, "openentry");
+    return s;
+}
+
+void
+closestream(Stream *s) {
+    if(s->close)
+        s->close(s);
+    poolput(s->buf);
+    free(s);
+}
+
+Node *
+pagenode(Node * parent, Node **images, int count) {
+    char *name= strdup("page"), *out;
+    int i, idx, entries;
+
+    /* named by the entries, the images may not be decoded yet */
+    position(parent, &idx, &entries);
+    for(i = 0; i < count; i++) {
+        asprintf(&out, "%s,%s", name, entryname(parent, idx - count + i));
+        free(name);
+        name = out;
+    }
+    Node *newnode =malloc(sizeof(Node));
+    *newnode = (Node) {
+        .parent = parent, .type = Page, .name = name,
+        .u = { .page = {
+               .count = count,
+               .images = images,
+        }}};
+    return newnode;
+}
+
+/* The decoded image, NULL when no decoder reads the stream, a preview is
+ * asked of one which has none, or its decode got cancelled or, with
+ * skipbad, failed */
+Node *
+imagenode(Node * parent, const char *name, Stream *s, vec2 fit, int preview) {
+    int i = decoder(sniff(s->data, s->size));
+    Node *newnode;
+    jmp_buf fail;
+
+    if(i == -1 || (preview && !decoders[i].preview))
+        return NULL;
+    newnode = malloc(sizeof(Node));
+    *newnode = (Node){ .type = Image,
+                       .name = strdup(name),
+                       .parent = parent };
+    decodefail = skipbad ? &fail : NULL;
+    if(setjmp(fail)) {
+        /* a bad page, skipped */
+        poolput(IMG(newnode).imagebuf);
+        IMG(newnode).imagebuf = NULL;
+    } else
+        decoders[i].decode(s, newnode, fit, preview);
+    decodefail = NULL;
+    if(!IMG(newnode).imagebuf) {
+        /* cancelled or skipped */
+        free(newnode->name);
+        free(newnode);
+        return NULL;
+    }
+    return newnode;
+}
+
+/* decode-ahead worker pool */
+enum {
+    Queued,
+    Running,
+};
+
+/* what a job makes of its entry */
+enum {
+    PageJob,        /* an image fitting the view */
+    PreviewJob,     /* a quick preview, for a page shown before it is decoded */
+    ThumbJob,       /* the grid thumbnail */
+};
+
+typedef struct Job Job;
+struct Job {
+    Node *container;
+    int idx, state, kind;
+    int cancel;     /* set on a running decode of a page seeked past */
+    vec2 fit;
+    Job *next;
+};
+
+/* Decoded images, keyed by container name and entry index. Pages hold a
+ * reference on their images, unreferenced ones are evicted least recently
+ * used first once the cache grows over cachelimit. An image replaced by a
+ * larger decode while still referenced is left stale, with idx -1. The
+ * entries are found through CACHE_BUCKETS chains by key and as many by
+ * image, and count the mips made of their image. */
+typedef struct Cached Cached;
+struct Cached {
+    char *key;
+    int idx, refs;
+    uint64_t hash;      /* of key and idx */
+    size_t bytes;
+    Node *image;
+    Cached *prev, *next;
+    Cached *keynext, *imagenext;
+};
+
+#define CACHE_BUCKETS   256
+
+static pthread_t workers[PREFETCH_THREADS];
+static pthread_mutex_t joblock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobcond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t donecond = PTHREAD_COND_INITIALIZER;
+static Job *jobs;
+static int seekdir = 1;
+static int wakefd[2] = { -1, -1 };  /* workers tell run() about finished images */
+static Cached *cachehead, *cachetail;
+static Cached *cachekeys[CACHE_BUCKETS], *cacheimages[CACHE_BUCKETS];
+static size_t cachebytes, cachelimit = CACHE_LIMIT;
+
+static void
+cacheunlink(Cached *c) {
+    *(c->prev ? &c->prev->next : &cachehead) = c->next;
+    *(c->next ? &c->next->prev : &cachetail) = c->prev;
+}
+
+static void
+cachefront(Cached *c) {
+    c->prev = NULL;
+    c->next = cachehead;
+    *(cachehead ? &cachehead->prev : &cachetail) = c;
+    cachehead = c;
+}
+
+static uint64_t
+cachehash(const char *key, int idx) {
+    return (keyhash(KEYHASH, key) ^ (unsigned)idx) * 0x100000001b3ULL;
+}
+
+static Cached **
+imagebucket(Node *image) {
+    return &cacheimages[((uintptr_t)image >> 4) % CACHE_BUCKETS];
+}
+
+static Cached *
+cachefind(Node *container, int idx) {
+    Cached *c;
+    for(c = cachekeys[cachehash(container->name, idx) % CACHE_BUCKETS]; c; c = c->keynext)
+        if(c->idx == idx && !strcmp(c->key, container->name))
+            break;
+    return c;
+}
+
+/* The entry of a cached image, NULL for one which is not */
+static Cached *
+cachedimage(Node *image) {
+    Cached *c;
+    for(c = *imagebucket(image); c && c->image != image; c = c->imagenext);
+    return c;
+}
+
+/* What decodes are made to fit: the view, times the zoom */
+static vec2
+zoomfit(void) {
+    return vec2_scale(viewsize, zoom);
+}
+
+static int
+cachefits(Cached *c, vec2 fit) {
+    return IMG(c->image).scale >= dctscale(IMG(c->image).full, fit);
+}
+
+static void
+cachefree(Cached *c) {
+    Cached **p;
+
+    for(p = &cachekeys[c->hash % CACHE_BUCKETS]; *p != c; p = &(*p)->keynext);
+    *p = c->keynext;
+    for(p = imagebucket(c->image); *p != c; p = &(*p)->imagenext);
+    *p = c->imagenext;
+    cacheunlink(c);
+    cachebytes -= c->bytes;
+    cleanupnode(c->image);
+    free(c->key);
+    free(c);
+}
+
+static void
+cacheevict(void) {
+    Cached *c, *prev;
+    for(c = cachetail; c && cachebytes > cachelimit; c = prev) {
+        prev = c->prev;
+        if(!c->refs)
+            cachefree(c);
+    }
+}
+
+static Node *
+cacheref(Cached *c) {
+    ++c->refs;
+    cacheunlink(c);
+    cachefront(c);
+    return c->image;
+}
+
+/* Returns a referenced image, decoded large enough for fit, the caller must
+ * hold joblock */
+static Node *
+cacheget(Node *container, int idx, vec2 fit) {
+    Cached *c;
+    if(!(c = cachefind(container, idx)) || !cachefits(c, fit))
+        return NULL;
+    return cacheref(c);
+}
+
+/* Any decode of an entry, however small */
+static Node *
+cachepreview(Node *container, int idx) {
+    Cached *c = cachefind(container, idx);
+    return c ? cacheref(c) : NULL;
+}
+
+static Node *
+cacheput(Node *container, int idx, Node *image, int refs) {
+    uint64_t hash = cachehash(container->name, idx);
+    Cached *c;
+
+    if((c = cachefind(container, idx))) {
+        if(IMG(c->image).scale >= IMG(image).scale) {
+            cleanupnode(image);
+            c->refs += refs;
+            return c->image;
+        }
+        if(c->refs)
+            c->idx = -1;
+        else
+            cachefree(c);
+    }
+
+    c = malloc(sizeof(Cached));
+    *c = (Cached){
+        .key = strdup(container->name), .idx = idx, .refs = refs,
+        .hash = hash,
+        .bytes = (size_t)PIXELSIZE(IMG(image).format) * IMG(image).size.x * IMG(image).size.y,
+        .image = image,
+        .keynext = cachekeys[hash % CACHE_BUCKETS],
+        .imagenext = *imagebucket(image),
+    };
+    cachekeys[hash % CACHE_BUCKETS] = c;
+    *imagebucket(image) = c;
+    cachefront(c);
+    cachebytes += c->bytes;
+    cacheevict();
+    return image;
+}
+
+static void
+cacheunref(Node *image) {
+    Cached *c;
+
+    if(!(c = cachedimage(image)))
+        die("BUG: releasing an image which is not cached\n");
+    if(!--c->refs && c->idx == -1)
+        cachefree(c);
+    cacheevict();
+}
+
+static void
+cacherelease(Node *image) {
+    pthread_mutex_lock(&joblock);
+    cacheunref(image);
+    pthread_mutex_unlock(&joblock);
+}
+
+/* Counts bytes made of a cached image, its mips, with it */
+static void
+cachegrow(Node *image, size_t bytes) {
+    Cached *c;
+
+    pthread_mutex_lock(&joblock);
+    if((c = cachedimage(image))) {
+        c->bytes += bytes;
+        cachebytes += bytes;
+        cacheevict();
+    }
+    pthread_mutex_unlock(&joblock);
+}
+
+/* A job which is not cancelled */
+static Job **
+findjob(Node *container, int idx, int kind) {
+    Job **job;
+    for(job = &jobs; *job; job = &(*job)->next)
+        if((*job)->container == container && (*job)->idx == idx && (*job)->kind == kind
+                && !(*job)->cancel)
+            break;
+    return job;
+}
+
+static void
+canceljob(Job *j) {
+    __atomic_store_n(&j->cancel, 1, __ATOMIC_RELAXED);
+}
+
+static Node *
+prefetchload(Node *container, int idx, vec2 fit, int preview, int *cancel) {
+    char *name;
+    Stream *s;
+    Node *image = NULL;
+    int i;
+
+    /* archives in a file list are not read by workers, nor files for a
+     * preview their decoder cannot make */
+    if(!container->openentry &&
+            ((i = decoder(sniffile(__atomic_load_n(&FL(container).filenames, __ATOMIC_ACQUIRE)[idx]))) == -1 ||
+             (preview && !decoders[i].preview)))
+        return NULL;
+    if(!(s = openentry(container, idx, &name)))
+        return NULL;
+    s->cancel = cancel;
+    image = imagenode(NULL, name, s, fit, preview);
+    closestream(s);
+    free(name);
+    return image;
+}
+
+void *
+prefetchworker(void *arg) {
+    Job *job, **j;
+    Node *image;
+    vec2 fit;
+    int kind, late, made;
+
+    pthread_mutex_lock(&joblock);
+    while(running) {
+        for(job = jobs; job && job->state != Queued; job = job->next);
+        if(!job) {
+            pthread_cond_wait(&jobcond, &joblock);
+            continue;
+        }
+
+        job->state = Running;
+        fit = job->fit;
+        kind = job->kind;
+        /* a preview is late once any decode is there */
+        late = kind == PreviewJob && cachefind(job->container, job->idx);
+        pthread_mutex_unlock(&joblock);
+        TRACEBEGIN(span);
+        image = NULL;
+        if(kind == ThumbJob)
+            thumbload(job->container, job->idx);
+        else if(kind == PreviewJob) {
+            if(!late)
+                image = prefetchload(job->container, job->idx, fit, 1, &job->cancel);
+        } else if((image = prefetchload(job->container, job->idx, fit, 0, &job->cancel))) {
+            /* the grid gets a page decoded anyway for free */
+            pthread_mutex_lock(&joblock);
+            made = !job->container->thumbs || thumbmade(job->container, job->idx);
+            pthread_mutex_unlock(&joblock);
+            if(!made)
+                putthumb(job->container, job->idx, image);
+        }
+        TRACEEND(span, kind == ThumbJob ? "thumbload" : kind == PreviewJob ? "previewload" : "prefetchload");
+        pthread_mutex_lock(&joblock);
+
+        if(image)
+            cacheput(job->container, job->idx, image, 0);
+        for(j = &jobs; *j != job; j = &(*j)->next);
+        *j = job->next;
+        free(job);
+        pthread_cond_broadcast(&donecond);
+        /* it may fill or refine the page or grid on screen, or have failed
+         * for it, a full pipe has the news already */
+        if(wakefd[1] != -1 && write(wakefd[1], "", 1) == -1 && errno != EAGAIN)
+            die("Failed to wake the main loop: %s\n", strerror(errno));
+    }
+    pthread_mutex_unlock(&joblock);
+    return NULL;
+}
+
+/* Next entry to load and number of entries of a container */
+static void
+position(Node *container, int *idx, int *count) {
+#ifdef ARCHIVE
+    if(container->type == Archive) {
+        *idx = AR(container).idx;
+        *count = AR(container).count;
+        return;
+    }
+#endif
+    *idx = FL(container).idx;
+    *count = FL(container).count;
+}
+
+static const char *
+entryname(Node *container, int idx) {
+#ifdef ARCHIVE
+    if(container->type == Archive)
+        return AR(container).names + AR(container).entries[idx].name;
+#endif
+    return FL(container).filenames[idx];
+}
+
+/* The entry of a container shown, counted from 1: the first image of the
+ * page, or the container opened from it */
+static int
+shownentry(Node *container) {
+    int idx, count;
+
+    position(container, &idx, &count);
+    if(curnode->type == Page && curnode->parent == container)
+        idx -= PG(curnode).count;
+    return idx + 1;
+}
+
+/* A Directory lists the files under it in order: the entries of every
+ * directory sorted by name, digits by their value, with subdirectories in
+ * their place. SCAN_THREADS list directories in parallel, and a file is
+ * taken as soon as every directory before it is listed, so the first page
+ * shows long before the whole tree is read. Files are known by the
+ * endings of their names, or by their first bytes for other endings, and
+ * those no decoder or archive reader takes are left out, as are hidden ones
+ * and links to directories. Unlike a file given alone, one of no type
+ * sniff() knows is not tried as an archive. */
+typedef struct Dir Dir;
+typedef struct {
+    char *name;
+    Dir *sub;           /* of a directory */
+} DirItem;
+
+struct Dir {
+    char *path;
+    DirItem *items;
+    int count, size;
+    int listed;
+    Dir *next;          /* in the queue of directories to list */
+};
+
+struct Scan {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;    /* a directory got listed */
+    pthread_t threads[SCAN_THREADS];
+    Dir *root, *queue;
+    int pending;            /* directories queued or being listed */
+    int stop, done;
+    struct {
+        Dir *dir;
+        int at;             /* its next item */
+    } *stack;               /* of the walk, where the files taken end */
+    int depth, stacksize;
+    char **names;           /* files taken */
+    int count, size;
+    char **retired[32];     /* smaller copies of names, which workers may read */
+    int nretired;
+    int refs;               /* nodes listing it, and the page index */
+};
+
+typedef struct {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} Dirent64;
+
+/* d_type of Dirent64 */
+enum {
+    DirentUnknown = 0,
+    DirentDir = 4,
+    DirentReg = 8,
+    DirentLink = 10,
+};
+
+#define DIRENTS_SIZE    (1 << 16)
+
+/* What files of a directory are, by the ending of their names */
+static const struct {
+    const char *ext;
+    int type;
+} extensions[] = {
+    { "jpg", FileJPEG }, { "jpeg", FileJPEG }, { "png", FilePNG }, { "webp", FileWebP },
+    { "cbz", FileArchive }, { "zip", FileArchive }, { "cbr", FileArchive },
+    { "rar", FileArchive }, { "cbt", FileArchive }, { "tar", FileArchive },
+    { "cb7", FileArchive }, { "7z", FileArchive },
+};
+
+/* Whether a file of the directory at dirfd is read, by the ending of its
+ * name or, for other endings, by its first bytes */
+static int
+readable(int dirfd, const char *name) {
+    const char *ext = strrchr(name, '.');
+    unsigned char magic[SNIFF_SIZE];
+    ssize_t n;
+    int i, fd, type = FileUnknown;
+
+    for(i = 0; ext && i < LENGTH(extensions) && strcasecmp(ext + 1, extensions[i].ext); i++);
+    if(ext && i < LENGTH(extensions))
+        type = extensions[i].type;
+    else if((fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC)) != -1) {
+        n = read(fd, magic, sizeof(magic));
+        close(fd);
+        type = n > 0 ? sniff(magic, n) : FileUnknown;
+    }
+#ifdef ARCHIVE
+    if(type == FileArchive)
+        return 1;
+#endif
+    return decoder(type) != -1;
+}
+
+/* Orders runs of digits by their value, like sort -V */
+static int
+natcmp(const char *a, const char *b) {
+    size_t m, n;
+    int c;
+
+    while(*a && *b) {
+        if(isdigit((unsigned char)*a) && isdigit((unsigned char)*b)) {
+            for(; *a == '0'; a++);
+            for(; *b == '0'; b++);
+            for(m = 0; isdigit((unsigned char)a[m]); m++);
+            for(n = 0; isdigit((unsigned char)b[n]); n++);
+            if(m != n)
+                return m < n ? -1 : 1;
+            if((c = memcmp(a, b, m)))
+                return c;
+            a += m;
+            b += n;
+        } else if(*a != *b)
+            break;
+        else {
+            a++;
+            b++;
+        }
+    }
+    return (unsigned char)*a - (unsigned char)*b;
+}
+
+static int
+cmpitem(const void *a, const void *b) {
+    const DirItem *x = a, *y = b;
+    int c = natcmp(x->name, y->name);
+
+    return c ? c : strcmp(x->name, y->name);
+}
+
+static char *
+joinpath(const char *dir, const char *name) {
+    char *path;
+    size_t len = strlen(dir);
+
+    if(asprintf(&path, "%s%s%s", dir, len && dir[len - 1] == '/' ? "" : "/", name) == -1)
+        die("Failed to allocate a path\n");
+    return path;
+}
+
+static Dir *
+newdir(char *path) {
+    Dir *d = calloc(1, sizeof(Dir));
+
+    if(!d)
+        die("Failed to allocate a directory\n");
+    d->path = path;
+    return d;
+}
+
+static void
+additem(Dir *d, const char *name, Dir *sub) {
+    if(d->count == d->size) {
+        d->size = d->size ? d->size * 2 : 64;
+        if(!(d->items = realloc(d->items, d->size * sizeof(DirItem))))
+            die("Failed to allocate a directory listing\n");
+    }
+    d->items[d->count++] = (DirItem){ .name = strdup(name), .sub = sub };
+}
+
+/* Reads the entries of d with getdents64 and sorts them. Unreadable
+ * directories are empty. */
+static void
+listdir(Scan *scan, Dir *d) {
+    Dirent64 *e;
+    struct stat st;
+    char *buf;
+    long n, off;
+    int fd, type;
+    TRACEBEGIN(span);
+
+    if((fd = open(d->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+        return;
+    if(!(buf = malloc(DIRENTS_SIZE)))
+        die("Failed to allocate a directory listing\n");
+    while(!__atomic_load_n(&scan->stop, __ATOMIC_RELAXED) &&
+            (n = syscall(SYS_getdents64, fd, buf, DIRENTS_SIZE)) > 0) {
+        for(off = 0; off < n; off += e->d_reclen) {
+            e = (Dirent64 *)(buf + off);
+            if(e->d_name[0] == '.')
+                continue;
+            type = e->d_type;
+            if(type == DirentUnknown && fstatat(fd, e->d_name, &st, AT_SYMLINK_NOFOLLOW) != -1)
+                type = S_ISDIR(st.st_mode) ? DirentDir : S_ISLNK(st.st_mode) ? DirentLink :
+                    S_ISREG(st.st_mode) ? DirentReg : DirentUnknown;
+            /* links are followed to files only, a tree of them may be cyclic */
+            if(type == DirentLink && fstatat(fd, e->d_name, &st, 0) != -1 && S_ISREG(st.st_mode))
+                type = DirentReg;
+            if(type == DirentDir)
+                additem(d, e->d_name, newdir(joinpath(d->path, e->d_name)));
+            else if(type == DirentReg && readable(fd, e->d_name))
+                additem(d, e->d_name, NULL);
+        }
+    }
+    close(fd);
+    free(buf);
+    qsort(d->items, d->count, sizeof(DirItem), cmpitem);
+    TRACEEND(span, "listdir");
+}
+
+static void
+pushdir(Scan *scan, Dir *d) {
+    if(scan->depth == scan->stacksize) {
+        scan->stacksize = scan->stacksize ? scan->stacksize * 2 : 16;
+        if(!(scan->stack = realloc(scan->stack, scan->stacksize * sizeof(*scan->stack))))
+            die("Failed to allocate a directory walk\n");
+    }
+    scan->stack[scan->depth].dir = d;
+    scan->stack[scan->depth++].at = 0;
+}
+
+/* Workers may be reading names while it grows, so the old copy stays */
+static void
+takefile(Scan *scan, Dir *d, const char *name) {
+    char **names;
+
+    if(scan->count == scan->size) {
+        scan->size = scan->size ? scan->size * 2 : 256;
+        if(!(names = malloc(scan->size * sizeof(char *))))
+            die("Failed to allocate a directory listing\n");
+        if(scan->names) {
+            memcpy(names, scan->names, scan->count * sizeof(char *));
+            scan->retired[scan->nretired++] = scan->names;
+        }
+        scan->names = names;
+    }
+    scan->names[scan->count++] = joinpath(d->path, name);
+}
+
+/* Takes the files up to the first directory not listed yet, under lock */
+static void
+dirwalk(Scan *scan) {
+    Dir *d;
+    DirItem *item;
+
+    while(scan->depth) {
+        d = scan->stack[scan->depth - 1].dir;
+        if(!d->listed)
+            return;
+        if(scan->stack[scan->depth - 1].at == d->count) {
+            scan->depth--;
+            continue;
+        }
+        item = &d->items[scan->stack[scan->depth - 1].at++];
+        if(item->sub)
+            pushdir(scan, item->sub);
+        else
+            takefile(scan, d, item->name);
+    }
+    scan->done = 1;
+}
+
+static void *
+scanworker(void *arg) {
+    Scan *scan = arg;
+    Dir *d;
+    int i;
+
+    pthread_mutex_lock(&scan->lock);
+    for(;;) {
+        while(!scan->queue && scan->pending && !scan->stop)
+            pthread_cond_wait(&scan->cond, &scan->lock);
+        if(!scan->queue || scan->stop)
+            break;
+        d = scan->queue;
+        scan->queue = d->next;
+        pthread_mutex_unlock(&scan->lock);
+
+        listdir(scan, d);
+
+        pthread_mutex_lock(&scan->lock);
+        /* depth first, the walk waits for the first subdirectory */
+        for(i = d->count - 1; i >= 0; i--) {
+            if(!d->items[i].sub)
+                continue;
+            d->items[i].sub->next = scan->queue;
+            scan->queue = d->items[i].sub;
+            scan->pending++;
+        }
+        d->listed = 1;
+        scan->pending--;
+        i = scan->count;
+        dirwalk(scan);
+        pthread_cond_broadcast(&scan->cond);
+        if((scan->count != i || scan->done) && wakefd[1] != -1 &&
+                write(wakefd[1], "", 1) == -1 && errno != EAGAIN)
+            die("Failed to wake the main loop: %s\n", strerror(errno));
+    }
+    pthread_mutex_unlock(&scan->lock);
+    return NULL;
+}
+
+/* Shows the files taken so far to the main thread, under lock. Returns
+ * whether there are new ones. */
+static int
+dirpublish(Node *node) {
+    Scan *scan = FL(node).scan;
+    int changed = FL(node).count != scan->count;
+
+    __atomic_store_n(&FL(node).filenames, (char * const *)scan->names, __ATOMIC_RELEASE);
+    FL(node).count = scan->count;
+    return changed;
+}
+
+/* Waits until count files are taken or the whole tree is */
+static void
+dirwait(Node *node, int count) {
+    Scan *scan = FL(node).scan;
+
+    pthread_mutex_lock(&scan->lock);
+    while(scan->count < count && !scan->done)
+        pthread_cond_wait(&scan->cond, &scan->lock);
+    dirpublish(node);
+    pthread_mutex_unlock(&scan->lock);
+    growthumbs(node);
+}
+
+/* Takes the files the directories curnode is in got since, returns whether
+ * there were any */
+static int
+dirupdate(void) {
+    Node *n;
+    int changed = 0;
+
+    for(n = curnode; n; n = n->parent) {
+        if(n->type != Directory)
+            continue;
+        pthread_mutex_lock(&FL(n).scan->lock);
+        changed |= dirpublish(n);
+        pthread_mutex_unlock(&FL(n).scan->lock);
+        growthumbs(n);
+    }
+    return changed;
+}
+
+static char *
+dirgentitle(Node *node, char *parenttitle) {
+    char *title;
+    asprintf(&title, "%s %s [%d/%d%s] |", parenttitle, node->name, shownentry(node),
+            FL(node).count, FL(node).scan->done ? "" : "+");
+    return title;
+}
+
+static void
+freedir(Dir *d) {
+    int i;
+
+    for(i = 0; i < d->count; i++) {
+        if(d->items[i].sub)
+            freedir(d->items[i].sub);
+        free(d->items[i].name);
+    }
+    free(d->items);
+    free(d->path);
+    free(d);
+}
+
+static void
+scanrelease(Scan *scan) {
+    int i;
+
+    pthread_mutex_lock(&scan->lock);
+    if(--scan->refs) {
+        pthread_mutex_unlock(&scan->lock);
+        return;
+    }
+    __atomic_store_n(&scan->stop, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&scan->cond);
+    pthread_mutex_unlock(&scan->lock);
+    for(i = 0; i < SCAN_THREADS; i++)
+        pthread_join(scan->threads[i], NULL);
+    freedir(scan->root);
+    for(i = 0; i < scan->count; i++)
+        free(scan->names[i]);
+    free(scan->names);
+    for(i = 0; i < scan->nretired; i++)
+        free(scan->retired[i]);
+    free(scan->stack);
+    pthread_mutex_destroy(&scan->lock);
+    pthread_cond_destroy(&scan->cond);
+    free(scan);
+}
+
+static void
+dircleanup(Node *node) {
+    scanrelease(FL(node).scan);
+}
+
+/* Starts listing the tree under path, NULL when path is no directory */
+static Scan *
+dirscan(const char *path) {
+    struct stat st;
+    Scan *scan;
+    int i;
+
+    if(stat(path, &st) == -1 || !S_ISDIR(st.st_mode))
+        return NULL;
+    if(!(scan = calloc(1, sizeof(Scan))))
+        die("Failed to allocate a directory listing\n");
+    pthread_mutex_init(&scan->lock, NULL);
+    pthread_cond_init(&scan->cond, NULL);
+    scan->root = scan->queue = newdir(strdup(path));
+    scan->pending = 1;
+    scan->refs = 1;
+    pushdir(scan, scan->root);
+    for(i = 0; i < SCAN_THREADS; i++)
+        if(pthread_create(&scan->threads[i], NULL, scanworker, scan))
+            die("Failed to create a directory lister\n");
+    return scan;
+}
+
+/* A node of the files scan lists, which takes over a reference to it.
+ * Returns once its first file is known or the tree has none. */
+static Node *
+scannode(Node *parent, const char *path, Scan *scan) {
+    Node *node;
+
+    node = malloc(sizeof(Node));
+    *node = (Node){
+        .type = Directory,
+        .name = strdup(path),
+        .parent = parent,
+        .gentitle = dirgentitle,
+        .cleanup = dircleanup,
+        .u = { .filelist = { .scan = scan } }
+    };
+    dirwait(node, 1);
+    return node;
+}
+
+static Node *
+dirnode(Node *parent, const char *path) {
+    Scan *scan = dirscan(path);
+
+    return scan ? scannode(parent, path, scan) : NULL;
+}
+
+/* The pages of the inputs, counted in the background by INDEX_THREADS so
+ * that pages are numbered across all of them: an image is one page, an
+ * archive one per entry and a directory the pages of its files. Archives
+ * are opened as for reading, so their entry tables are cached on disk by
+ * the time they are shown. first holds the number of the first page of
+ * each input once all inputs before it are counted. Pages are not probed
+ * for their size: nothing is laid out before its decode, which gives the
+ * size anyway, and probing would inflate the head of every compressed
+ * entry. */
+typedef struct {
+    int pages;          /* -1 until counted */
+    int *files;         /* of a directory, the first page of each file and the end */
+    int nfiles;
+} Input;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_t threads[INDEX_THREADS];
+    Node *root;
+    Input *inputs;
+    Scan **scans;       /* of directory inputs not counted yet, shared with the viewer */
+    int *first;
+    int count;
+    int next;           /* input counted next */
+    int known;          /* inputs counted from the first on */
+    int shown;          /* known when the title was made */
+    int stop;
+} Index;
+
+static Index *pageindex;
+
+static int
+countfile(const char *path) {
+    int pages = 1;
+#ifdef ARCHIVE
+    Node *node;
+    int type;
+
+    if((node = sniffarchive(NULL, path, &type))) {
+        pages = AR(node).count;
+        cleanupnode(node);
+    }
+#endif
+    return pages;
+}
+
+/* The listing of input i when it is a directory, the same for the viewer
+ * and the index until the index counted it. Returns a reference. */
+static Scan *
+inputscan(Index *ix, int i) {
+    Scan *scan;
+
+    pthread_mutex_lock(&ix->lock);
+    if((scan = ix->scans[i])) {
+        pthread_mutex_lock(&scan->lock);
+        scan->refs++;
+        pthread_mutex_unlock(&scan->lock);
+    } else if((scan = dirscan(FL(ix->root).filenames[i])) && ix->inputs[i].pages < 0) {
+        scan->refs++;
+        ix->scans[i] = scan;
+    }
+    pthread_mutex_unlock(&ix->lock);
+    return scan;
+}
+
+static Input
+countinput(Index *ix, int idx) {
+    const char *path = FL(ix->root).filenames[idx];
+    Input in = { .pages = 1 };
+    Scan *scan;
+    Node *dir;
+    int i;
+
+    if(!(scan = inputscan(ix, idx)))
+        return (Input){ .pages = countfile(path) };
+    dir = scannode(NULL, path, scan);
+    dirwait(dir, INT_MAX);
+    in.nfiles = FL(dir).count;
+    if(!(in.files = malloc((in.nfiles + 1) * sizeof(int))))
+        die("Failed to allocate the page index\n");
+    in.files[0] = 0;
+    for(i = 0; i < in.nfiles && !__atomic_load_n(&ix->stop, __ATOMIC_RELAXED); i++)
+        in.files[i + 1] = in.files[i] + countfile(FL(dir).filenames[i]);
+    in.nfiles = i;
+    in.pages = in.files[i];
+    cleanupnode(dir);
+    return in;
+}
+
+static void *
+indexworker(void *arg) {
+    Index *ix = arg;
+    Input in;
+    int i;
+
+    pthread_mutex_lock(&ix->lock);
+    while(!ix->stop && ix->next < ix->count) {
+        i = ix->next++;
+        pthread_mutex_unlock(&ix->lock);
+        in = countinput(ix, i);
+        pthread_mutex_lock(&ix->lock);
+        ix->inputs[i] = in;
+        if(ix->scans[i])
+            scanrelease(ix->scans[i]);
+        ix->scans[i] = NULL;
+        for(; ix->known < ix->count && ix->inputs[ix->known].pages >= 0; ix->known++)
+            ix->first[ix->known + 1] = ix->first[ix->known] + ix->inputs[ix->known].pages;
+        /* the title shows the pages counted, a full pipe has the news already */
+        if(wakefd[1] != -1 && write(wakefd[1], "", 1) == -1 && errno != EAGAIN)
+            die("Failed to wake the main loop: %s\n", strerror(errno));
+    }
+    pthread_mutex_unlock(&ix->lock);
+    return NULL;
+}
+
+/* Starts counting the pages of the files of root */
+static void
+indexinputs(Node *root) {
+    Index *ix;
+    int i;
+
+    if(!(ix = calloc(1, sizeof(Index))) ||
+            !(ix->inputs = malloc(FL(root).count * sizeof(Input))) ||
+            !(ix->first = calloc(FL(root).count + 1, sizeof(int))) ||
+            !(ix->scans = calloc(FL(root).count, sizeof(Scan *))))
+        die("Failed to allocate the page index\n");
+    pthread_mutex_init(&ix->lock, NULL);
+    ix->root = root;
+    ix->count = FL(root).count;
+    for(i = 0; i < ix->count; i++)
+        ix->inputs[i] = (Input){ .pages = -1 };
+    for(i = 0; i < INDEX_THREADS; i++)
+        if(pthread_create(&ix->threads[i], NULL, indexworker, ix))
+            die("Failed to create an index worker\n");
+    pageindex = ix;
+}
+
+/* Whether more inputs got counted since the last call */
+static int
+indexupdate(void) {
+    int changed;
+
+    if(!pageindex)
+        return 0;
+    pthread_mutex_lock(&pageindex->lock);
+    changed = pageindex->known != pageindex->shown;
+    pageindex->shown = pageindex->known;
+    pthread_mutex_unlock(&pageindex->lock);
+    return changed;
+}
+
+static void
+freeindex(void) {
+    Index *ix = pageindex;
+    int i;
+
+    if(!ix)
+        return;
+    pthread_mutex_lock(&ix->lock);
+    __atomic_store_n(&ix->stop, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&ix->lock);
+    for(i = 0; i < INDEX_THREADS; i++)
+        pthread_join(ix->threads[i], NULL);
+    for(i = 0; i < ix->count; i++) {
+        if(ix->inputs[i].pages >= 0)
+            free(ix->inputs[i].files);
+        if(ix->scans[i])
+            scanrelease(ix->scans[i]);
+    }
+    free(ix->inputs);
+    free(ix->scans);
+    free(ix->first);
+    pthread_mutex_destroy(&ix->lock);
+    free(ix);
+    pageindex = NULL;
+}
+
+/* Grid thumbnails of a container live in $XDG_CACHE_HOME/comic/<hash>.thm,
+ * mapped shared: the header, then one slot per entry, the slot header
+ * followed by GRID_SIZE * GRID_SIZE pixels of the frame layout. Slots are
+ * written by the workers and read by render, both under joblock. The file
+ * of a directory grows as it is listed. */
+struct ThumbHeader {
+    char magic[8];
+    uint32_t version, size, count, format;
+    uint64_t keylen, srcsize;
+    int64_t mtime, mtimensec;
+};
+
+typedef struct {
+    uint16_t w, h;      /* 0 until made */
+    uint32_t stamp;     /* hash of the path and mtime of a loose file */
+} ThumbSlot;
+
+#define THUMB_MAGIC     "comicthm"
+#define THUMB_VERSION   2
+#define THUMB_NONE      0xffff  /* w of entries which are no images */
+#define SLOTSIZE        (sizeof(ThumbSlot) + (size_t)GRID_SIZE * GRID_SIZE * 4)
+
+/* Hashes the real path of the container, or those of its files one per
+ * line, and returns the length of the key */
+static size_t
+containerkey(Node *container, uint64_t *hash) {
+    int i, list = container->type == FileList;
+    const char *name;
+    char *path;
+    size_t len = 0;
+
+    *hash = KEYHASH;
+    for(i = 0; i < (list ? FL(container).count : 1); i++) {
+        name = list ? FL(container).filenames[i] : container->name;
+        if(!(path = realpath(name, NULL)))
+            path = strdup(name);
+        *hash = keyhash(*hash, path);
+        len += strlen(path);
+        if(list) {
+            *hash = keyhash(*hash, "\n");
+            len++;
+        }
+        free(path);
+    }
+    return len;
+}
+
+static ThumbSlot *
+thumbslot(Node *container, int idx) {
+    return (ThumbSlot *)((char *)(container->thumbs + 1) + idx * SLOTSIZE);
+}
+
+/* A loose file changes in place or, in a directory, moves to another
+ * entry. An archive is checked as a whole. */
+static uint32_t
+thumbstamp(Node *container, int idx) {
+    return container->stamps ? container->stamps[idx] : 0;
+}
+
+/* Stamps of the first count entries, stating those from nstamps on */
+static uint32_t *
+stampthumbs(Node *container, int count) {
+    uint32_t *stamps;
+    uint64_t hash;
+    struct stat st;
+    int i;
+
+    if(container->openentry || !count)
+        return NULL;
+    if(!(stamps = malloc(count * sizeof(uint32_t))))
+        die("Failed to allocate thumbnails of %s\n", container->name);
+    if(container->nstamps)
+        memcpy(stamps, container->stamps, container->nstamps * sizeof(uint32_t));
+    for(i = container->nstamps; i < count; i++) {
+        hash = keyhash(KEYHASH, FL(container).filenames[i]);
+        if(stat(FL(container).filenames[i], &st) != -1)
+            hash = (hash ^ st.st_mtim.tv_sec) * 0x100000001b3ULL;
+        stamps[i] = hash ^ hash >> 32;
+    }
+    return stamps;
+}
+
+/* Maps the thumbnails of the container, starting over when the cache is
+ * stale and keeping them in memory when it cannot be written. A directory
+ * gets slots for the files listed so far, or those of a longer listing
+ * cached before. */
+static void
+openthumbs(Node *container) {
+    int fd, idx, count, reuse = 0;
+    uint32_t slots, *stamps;
+    char *file;
+    uint64_t hash;
+    size_t keylen, len;
+    struct stat st = { 0 }, cst;
+    ThumbHeader h, old;
+    void *map = MAP_FAILED;
+
+    position(container, &idx, &count);
+    /* stat here rather than per cell and frame under joblock */
+    stamps = stampthumbs(container, count);
+    keylen = containerkey(container, &hash);
+    if(container->type != FileList)
+        stat(container->name, &st);
+    h = (ThumbHeader){ .magic = THUMB_MAGIC, .version = THUMB_VERSION, .size = GRID_SIZE,
+        .count = count, .format = pixelformat, .keylen = keylen, .srcsize = st.st_size,
+        .mtime = st.st_mtim.tv_sec, .mtimensec = st.st_mtim.tv_nsec };
+
+    /* unmade slots are holes of the file, they read as zero */
+    if((file = cachepath(hash, ".thm")) && (fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) != -1) {
+        if(fstat(fd, &cst) != -1 && pread(fd, &old, sizeof(old), 0) == sizeof(old)) {
+            slots = old.count;
+            old.count = h.count;
+            reuse = !memcmp(&old, &h, sizeof(h)) && cst.st_size == sizeof(h) + slots * SLOTSIZE &&
+                (slots == h.count || (container->type == Directory && slots > h.count));
+            if(reuse)
+                h.count = slots;
+        }
+        len = sizeof(h) + h.count * SLOTSIZE;
+        if(reuse || (!ftruncate(fd, 0) && !ftruncate(fd, len) && pwrite(fd, &h, sizeof(h), 0) == sizeof(h)))
+            map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(map == MAP_FAILED)
+            close(fd);
+        else
+            container->thumbsfd = fd;
+    }
+    if(map == MAP_FAILED) {
+        len = sizeof(h) + h.count * SLOTSIZE;
+        map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(map == MAP_FAILED)
+            die("Failed to allocate thumbnails of %s\n", container->name);
+        memcpy(map, &h, sizeof(h));
+        container->thumbsfd = -1;
+    }
+    free(file);
+
+    pthread_mutex_lock(&joblock);
+    container->thumbs = map;
+    container->thumbslen = len;
+    container->stamps = stamps;
+    container->nstamps = count;
+    pthread_mutex_unlock(&joblock);
+}
+
+/* Lays out slots for the files a directory listed since the grid opened,
+ * called from the main thread once they are published */
+static void
+growthumbs(Node *container) {
+    int count = FL(container).count;
+    uint32_t *stamps;
+    size_t len = sizeof(ThumbHeader) + count * SLOTSIZE;
+    void *map;
+
+    if(!container->thumbs || count <= container->nstamps)
+        return;
+    stamps = stampthumbs(container, count);
+
+    pthread_mutex_lock(&joblock);
+    if(len > container->thumbslen) {
+        if(container->thumbsfd != -1 && ftruncate(container->thumbsfd, len) == -1) {
+            /* on in memory */
+            map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(map != MAP_FAILED) {
+                memcpy(map, container->thumbs, container->thumbslen);
+                munmap(container->thumbs, container->thumbslen);
+            }
+            close(container->thumbsfd);
+            container->thumbsfd = -1;
+        } else
+            map = mremap(container->thumbs, container->thumbslen, len, MREMAP_MAYMOVE);
+        if(map == MAP_FAILED)
+            die("Failed to allocate thumbnails of %s\n", container->name);
+        container->thumbs = map;
+        container->thumbslen = len;
+        container->thumbs->count = count;
+    }
+    free(container->stamps);
+    container->stamps = stamps;
+    container->nstamps = count;
+    pthread_mutex_unlock(&joblock);
+}
+
+static void
+closethumbs(Node *container) {
+    if(!container->thumbs)
+        return;
+    munmap(container->thumbs, container->thumbslen);
+    if(container->thumbsfd != -1)
+        close(container->thumbsfd);
+    container->thumbs = NULL;
+    free(container->stamps);
+    container->stamps = NULL;
+    container->nstamps = 0;
+}
+
+/* Whether the slot of entry idx holds its thumbnail, or knows it has none */
+static int
+thumbmade(Node *container, int idx) {
+    ThumbSlot *slot = thumbslot(container, idx);
+    return slot->w && slot->stamp == thumbstamp(container, idx);
+}
+
+/* Scales the image into the slot of entry idx, NULL marks it as no image */
+static void
+putthumb(Node *container, int idx, Node *image) {
+    vec2 size = { 0, 0 };
+    uint32_t *pixels = NULL;
+    ThumbSlot *slot;
+    double ratio;
+
+    if(image) {
+        ratio = MIN((double)GRID_SIZE / IMG(image).full.x, (double)GRID_SIZE / IMG(image).full.y);
+        size = vec2_scale(IMG(image).full, ratio);
+        size.x = MIN(MAX(size.x, 1), GRID_SIZE);
+        size.y = MIN(MAX(size.y, 1), GRID_SIZE);
+        if(!(pixels = poolget((size_t)size.x * size.y * 4)))
+            die("Failed to allocate a thumbnail\n");
+        resample(IMG(image).imagebuf, IMG(image).size.x, IMG(image).size.y,
+                IMG(image).size.x * PIXELSIZE(IMG(image).format), IMG(image).format,
+                pixels, size.x, size.x, size.y, filter);
+    }
+
+    pthread_mutex_lock(&joblock);
+    if(container->thumbs) {
+        slot = thumbslot(container, idx);
+        if(pixels)
+            memcpy(slot + 1, pixels, (size_t)size.x * size.y * 4);
+        slot->stamp = thumbstamp(container, idx);
+        slot->h = size.y;
+        slot->w = image ? size.x : THUMB_NONE;
+    }
+    pthread_mutex_unlock(&joblock);
+    poolput(pixels);
+}
+
+/* Decodes entry idx just large enough for its grid thumbnail */
+static void
+thumbload(Node *container, int idx) {
+    Node *image = prefetchload(container, idx, (vec2){ .x = GRID_SIZE, .y = GRID_SIZE }, 0, NULL);
+
+    putthumb(container, idx, image);
+    if(image)
+        cleanupnode(image);
+}
+
+/* Queue the thumbnail of entry i, after those queued before. Called with
+ * joblock held. */
+static void
+thumbqueue(Node *container, int i) {
+    Job **tail, *j;
+
+    if(*findjob(container, i, ThumbJob))
+        return;
+    j = malloc(sizeof(Job));
+    *j = (Job){ .container = container, .idx = i, .state = Queued, .kind = ThumbJob };
+    for(tail = &jobs; *tail; tail = &(*tail)->next);
+    *tail = j;
+}
+
+/* Queue a decode of entry i to fit the view, after those queued before
+ * but ahead of the thumbnails */
+static void
+prefetchqueue(Node *container, int i) {
+    Job **job, *j, **tail;
+    Cached *c;
+
+    if((c = cachefind(container, i)) && cachefits(c, zoomfit()))
+        return;
+    if(*(job = findjob(container, i, PageJob))) {
+        j = *job;
+        *job = j->next;
+    } else {
+        j = malloc(sizeof(Job));
+        *j = (Job){ .container = container, .idx = i, .state = Queued, .kind = PageJob };
+    }
+    j->fit = zoomfit();
+    for(tail = &jobs; *tail && (*tail)->kind != ThumbJob; tail = &(*tail)->next);
+    j->next = *tail;
+    *tail = j;
+}
+
+/* Queue the pages around curnode in the direction of the last seek, nearest
+ * first, and drop the queued pages which are not needed anymore. The
+ * thumbnails stay queued until their container is closed. */
+void
+prefetch(void) {
+    Node *container = curnode->parent;
+    Job **job, *j;
+    int i, idx, count, first, last, lo, hi;
+
+    position(container, &idx, &count);
+
+    /* the page on screen may still be a preview */
+    if(seekdir > 0) {
+        lo = idx - PG(curnode).count;
+        first = idx;
+        hi = last = MIN(idx + PREFETCH_PAGES * imageperpage, count) - 1;
+    } else {
+        hi = idx - 1;
+        first = idx - PG(curnode).count - 1;
+        lo = last = MAX(first - PREFETCH_PAGES * imageperpage + 1, 0);
+    }
+
+    pthread_mutex_lock(&joblock);
+    for(job = &jobs; *job;) {
+        j = *job;
+        if(j->kind == ThumbJob || (j->container == container && j->idx >= lo && j->idx <= hi))
+            job = &j->next;
+        else if(j->state == Queued) {
+            *job = j->next;
+            free(j);
+        } else {
+            /* decodes of the pages seeked past are given up */
+            canceljob(j);
+            job = &j->next;
+        }
+    }
+
+    /* Reorder so that the workers pick the nearest page first */
+    for(i = idx - PG(curnode).count; i < idx; i++)
+        prefetchqueue(container, i);
+    for(i = first; seekdir > 0 ? i <= last : i >= last; i += seekdir)
+        prefetchqueue(container, i);
+    pthread_cond_broadcast(&jobcond);
+    pthread_mutex_unlock(&joblock);
+}
+
+/* The container is about to be freed: no worker may touch it afterwards.
+ * Its decoded images stay cached, the decodes still running are given up. */
+void
+prefetchcancel(Node *container) {
+    Job **job, *j;
+
+    pthread_mutex_lock(&joblock);
+    for(job = &jobs; *job;) {
+        j = *job;
+        if(j->container == container && j->state == Queued) {
+            *job = j->next;
+            free(j);
+        } else {
+            if(j->container == container)
+                canceljob(j);
+            job = &j->next;
+        }
+    }
+    for(;;) {
+        for(job = &jobs; *job && (*job)->container != container; job = &(*job)->next);
+        if(!*job)
+            break;
+        pthread_cond_wait(&donecond, &joblock);
+    }
+    pthread_mutex_unlock(&joblock);
+}
+
+/* Queue a job of an entry ahead of all others, or move it there while it
+ * waits. Called with joblock held. */
+static void
+queuefirst(Node *container, int idx, int kind) {
+    Job **job, *j;
+
+    if(!*(job = findjob(container, idx, kind))) {
+        j = malloc(sizeof(Job));
+        *j = (Job){ .container = container, .idx = idx, .state = Queued, .kind = kind };
+    } else if((*job)->state == Queued) {
+        j = *job;
+        *job = j->next;
+    } else
+        return;
+    j->fit = zoomfit();
+    j->next = jobs;
+    jobs = j;
+}
+
+/* The image of an entry, or a quick preview of it until a worker decoded it
+ * to fit the view. Without either, NULL: the page is shown once a worker
+ * made the preview, queued first, or the image, decoded beside it. */
+Node *
+loadimage(Node *container, int idx) {
+    Node *image;
+
+    pthread_mutex_lock(&joblock);
+    if(!(image = cacheget(container, idx, zoomfit()))) {
+        queuefirst(container, idx, PageJob);
+        if(!(image = cachepreview(container, idx)))
+            queuefirst(container, idx, PreviewJob);
+        pthread_cond_broadcast(&jobcond);
+    }
+    pthread_mutex_unlock(&joblock);
+    return image;
+}
+
+/* Decodes an entry to fit the view on the main thread, when the workers
+ * ended without an image of it */
+static Node *
+loadentry(Node *container, int idx) {
+    char *name;
+    Stream *s;
+    Node *image;
+
+    if(!(s = openentry(container, idx, &name)))
+        die("failed to read entry %d of %s\n", idx, container->name);
+    if(!(image = imagenode(NULL, name, s, zoomfit(), 0)))
+        die("%s: unsupported image format\n", name);
+    closestream(s);
+    free(name);
+    return image;
+}
+
+/* Whether every image of curnode is decoded, if only as a preview */
+static int
+pageready(void) {
+    int i;
+
+    for(i = 0; i < PG(curnode).count; i++)
+        if(!PG(curnode).images[i])
+            return 0;
+    return 1;
+}
+
+/* Swap in decodes of the images of curnode which fit the view better, or
+ * any for those still missing, and queue them while there are none.
+ * Returns whether any image changed. */
+int
+refreshpage(void) {
+    int i, idx, count, first, changed = 0, missing = 0;
+    Node *image, *better, *container = curnode->parent;
+
+    position(container, &idx, &count);
+    first = idx - PG(curnode).count;
+    pthread_mutex_lock(&joblock);
+    for(i = 0; i < PG(curnode).count; i++) {
+        image = PG(curnode).images[i];
+        if(image && IMG(image).scale >= dctscale(IMG(image).full, zoomfit()))
+            continue;
+        if(!(better = cacheget(container, first + i, zoomfit())) && !image)
+            better = cachepreview(container, first + i);
+        if(!better && !image && !*findjob(container, first + i, PageJob) &&
+                !*findjob(container, first + i, PreviewJob)) {
+            /* the workers failed on it, or it got evicted at once */
+            pthread_mutex_unlock(&joblock);
+            better = loadentry(container, first + i);
+            pthread_mutex_lock(&joblock);
+            better = cacheput(container, first + i, better, 1);
+        }
+        if(!better) {
+            missing = 1;
+            continue;
+        }
+        PG(curnode).images[i] = better;
+        if(image)
+            cacheunref(image);
+        changed = 1;
+    }
+    pthread_mutex_unlock(&joblock);
+    if(missing)
+        prefetch();
+    return changed;
+}
+
+/* The node of the current file of a file list when it is a directory or
+ * an archive, NULL for an image */
+static Node *
+opencontainer(Node *node) {
+    Node *newnode = NULL;
+    const char *file = FL(node).filenames[FL(node).idx];
+    Scan *scan;
 #ifdef ARCHIVE
-        newnode = archivenode(curnode, filename);
-        if(newnode) {
-            curnode = newnode;
-            loadnext();
-        } else
+    int type;
+#endif
+
+    // Directories are listed by a node of their own, the files of
+    // which never are directories. The page index may be listing
+    // the same one.
+    if(node->type == FileList &&
+            (scan = pageindex ? inputscan(pageindex, FL(node).idx) : dirscan(file)) &&
+            !FL(newnode = scannode(node, file, scan)).count)
+        die("%s: no images in it\n", file);
+#ifdef ARCHIVE
+    // Files go to their handler by their first bytes, images are never
+    // probed as archives.
+    if(!newnode) {
+        TRACEBEGIN(open);
+        newnode = sniffarchive(node, file, &type);
+        TRACEEND(open, "archivenode");
+        if(!newnode && type == FileArchive)
+            die("%s: failed to read the archive\n", file);
+    }
 #endif
-        {
-            // Cannot open given file as an archive, try to open as a image.
-            Node **images = malloc(sizeof(Node *) * imageperpage);
-            for(i = 0; i < imageperpage; i++) {
-                if(FL(node).idx == FL(node).count)
-                    break;
+    return newnode;
+}
 
-                filename = FL(node).filenames[FL(node).idx];
-                if(!(data = readfile(filename, &size)))
-                    die("failed to read file: %s", filename);
+void
+loadnext(void) {
+    int i;
+    struct Node *node, **images, *newnode;
+    TRACEBEGIN(span);
 
-                images[i] = imagenode(node, filename, data, size);
-                ++FL(node).idx;
-            }
-            newnode = pagenode(node, images, i);
+    node = curnode;
+    switch(node->type) {
+    case Image:
+    case Page:
+        moveoffset(imageperpage);
+        break;
+
+    case Directory:
+        dirwait(node, FL(node).idx + imageperpage);
+        /* fall through */
+    case FileList:
+        if((newnode = opencontainer(node))) {
             curnode = newnode;
+            loadnext();
+            break;
         }
+        // An image, or a file which cannot be opened as an archive. The
+        // page ends before the next archive or directory.
+        images = malloc(sizeof(Node *) * imageperpage);
+        for(i = 0; i < imageperpage && FL(node).idx < FL(node).count; i++, ++FL(node).idx)
+            if(i && decoder(sniffile(FL(node).filenames[FL(node).idx])) == -1)
+                break;
+            else
+                images[i] = loadimage(node, FL(node).idx);
+        curnode = pagenode(node, images, i);
         break;
     default:
         curnode = node->loadnext(node);
         break;
     }
+    TRACEEND(span, "loadnext");
 }
 
-XImage *
-createimage(Node *node, vec2 size) {
-    unsigned char *buf = IMG(node).imagebuf;
-    int w = IMG(node).size.x, h = IMG(node).size.y;
-    XImage *img = NULL;
-    int out_idx = 0;
-    int x, y, sample_x, sample_y;
-    uint32_t *imagebuf;
+static int
+shmerror(Display *dpy, XErrorEvent *e) {
+    shmfailed = True;
+    return 0;
+}
 
-    imagebuf = malloc(sizeof(uint32_t) * size.x * size.y);
-    // Nearest sampling
-    for(y = 0; y < size.y; y++) {
-        sample_y = y * h / size.y * w * 3;
-        for(x = 0; x < size.x; x++) {
-            sample_x = x * w / size.x * 3;
-            imagebuf[out_idx] = (*(uint32_t*)(buf + sample_y + sample_x)) << 8;
-            ++out_idx;
-        }
+/* An image in a shared segment, so that putting it copies nothing */
+static XImage *
+shmimage(vec2 size) {
+    XImage *img;
+    XErrorHandler handler;
+
+    img = XShmCreateImage(dpy, DefaultVisual(dpy, screen), DefaultDepth(dpy, screen),
+            ZPixmap, NULL, &shminfo, size.x, size.y);
+    if(!img)
+        return NULL;
+    /* pixels are written as they are, so the layout must be ours */
+    if(img->bits_per_pixel != 32 || img->byte_order != FRAMEORDER ||
+            (shminfo.shmid = shmget(IPC_PRIVATE, img->bytes_per_line * img->height,
+                IPC_CREAT | 0600)) == -1) {
+        XDestroyImage(img);
+        return NULL;
+    }
+    shminfo.shmaddr = img->data = shmat(shminfo.shmid, NULL, 0);
+    shminfo.readOnly = False;
+
+    /* attaching fails on remote displays, which only shows as an X error */
+    shmfailed = shminfo.shmaddr == (void *)-1;
+    if(!shmfailed) {
+        handler = XSetErrorHandler(shmerror);
+        XShmAttach(dpy, &shminfo);
+        XSync(dpy, False);
+        XSetErrorHandler(handler);
+    }
+    /* freed once both sides detach */
+    shmctl(shminfo.shmid, IPC_RMID, NULL);
+    if(shmfailed) {
+        if(shminfo.shmaddr != (void *)-1)
+            shmdt(shminfo.shmaddr);
+        shminfo.shmaddr = NULL;
+        img->data = NULL;
+        XDestroyImage(img);
+        return NULL;
+    }
+    return img;
+}
+
+/* The back buffer keeps its size until the view is rendered at another */
+void
+createbackbuf(vec2 size) {
+    if(backbuf && backsize.x == size.x && backsize.y == size.y)
+        return;
+    if(backbuf) {
+#ifdef XRENDER
+        if(backpict)
+            XRenderFreePicture(dpy, backpict);
+#endif
+        XFreePixmap(dpy, backbuf);
     }
+    backbuf = XCreatePixmap(dpy, win, size.x, size.y, DefaultDepth(dpy, screen));
+    backsize = size;
+#ifdef XRENDER
+    backpict = userender ? XRenderCreatePicture(dpy, backbuf, renderformat, 0, NULL) : None;
+#endif
+}
+
+XImage *
+createframe(vec2 size) {
+    XImage *img;
+
+    createbackbuf(size);
+    if(frame && frame->width == size.x && frame->height == size.y)
+        return frame;
+    destroyframe();
+
+    if(useshm && (frame = shmimage(size)))
+        return frame;
+    useshm = False;
 
     img = XCreateImage (dpy,
         CopyFromParent, DefaultDepth(dpy, screen),
         ZPixmap, 0,
-        (char *) imagebuf,
+        poolget(sizeof(uint32_t) * size.x * size.y),
         size.x, size.y,
         32, 0
     );
 
     XInitImage (img);
-    img->byte_order = MSBFirst;
+    img->byte_order = FRAMEORDER;
     img->bitmap_bit_order = MSBFirst;
 
-    return img;
+    return frame = img;
+}
+
+void
+destroyframe(void) {
+    if(!frame)
+        return;
+    if(shminfo.shmaddr) {
+        XShmDetach(dpy, &shminfo);
+        frame->data = NULL;
+        shmdt(shminfo.shmaddr);
+        shminfo.shmaddr = NULL;
+    } else {
+        poolput(frame->data);
+        frame->data = NULL;
+    }
+    XDestroyImage(frame);
+    frame = NULL;
+}
+
+/* Blank a part of the frame no image covers */
+void
+clearframe(int x, int y, int w, int h) {
+    char *row = frame->data + (size_t)y * frame->bytes_per_line + x * 4;
+
+    for(; w > 0 && h > 0; h--, row += frame->bytes_per_line)
+        memset(row, 0, (size_t)w * 4);
 }
 
 Window
@@ -505,11 +3253,18 @@ gentitle(Node *node) {
         return strdup("");
 
     char *title = NULL, *parenttitle;
+    int page;
     parenttitle = gentitle(node->parent);
     if(node->type == Image || node->type == Page)
         asprintf(&title, "%s %s", parenttitle, node->name);
-    else if(node->type == FileList)
-        asprintf(&title, "%s %s [%d/%d] |", parenttitle, node->name, FL(node).idx + 1, FL(node).count);
+    else if(node->type == FileList && pageindex && node == pageindex->root &&
+            (page = globalpage()) >= 0) {
+        pthread_mutex_lock(&pageindex->lock);
+        asprintf(&title, "%s %s [%d/%d%s] |", parenttitle, node->name, page + 1,
+                pageindex->first[pageindex->known], pageindex->known < pageindex->count ? "+" : "");
+        pthread_mutex_unlock(&pageindex->lock);
+    } else if(node->type == FileList)
+        asprintf(&title, "%s %s [%d/%d] |", parenttitle, node->name, shownentry(node), FL(node).count);
     else {
         title = node->gentitle(node, parenttitle);
     }
@@ -517,45 +3272,595 @@ gentitle(Node *node) {
     return title;
 }
 
+/* Sends the frame to the back buffer and shows all of it */
+void
+putframe(void) {
+    TRACEBEGIN(span);
+    if(useshm)
+        XShmPutImage(dpy, backbuf, gc, frame, 0, 0, 0, 0, viewsize.x, viewsize.y, False);
+    else
+        XPutImage (dpy, backbuf, gc, frame, 0, 0, 0, 0, viewsize.x, viewsize.y);
+    showframe();
+    if(useshm)
+        /* the server reads the segment later, wait before drawing into it again */
+        XSync(dpy, False);
+    else
+        XFlush (dpy);
+    TRACEEND(span, "putimage");
+}
+
+void
+showframe(void) {
+    XCopyArea(dpy, backbuf, win, gc, 0, 0, backsize.x, backsize.y, 0, 0);
+    if(damage) {
+        XDestroyRegion(damage);
+        damage = NULL;
+    }
+}
+
+/* Copies the exposed parts of the window from the back buffer, the frame
+ * is not rendered again */
+static void
+repaint(void) {
+    TRACEBEGIN(span);
+    XSetRegion(dpy, gc, damage);
+    XCopyArea(dpy, backbuf, win, gc, 0, 0, backsize.x, backsize.y, 0, 0);
+    XSetClipMask(dpy, gc, None);
+    XDestroyRegion(damage);
+    damage = NULL;
+    XFlush(dpy);
+    TRACEEND(span, "repaint");
+}
+
+#ifdef XRENDER
+/* Pages scaled by the server: each decoded image is uploaded once into a
+ * Picture, which is composited into the back buffer through a scaling
+ * transform. Another size or layout of the view costs the client nothing.
+ * The uploads are of the images of the page rendered last, in its order,
+ * and hold a reference to them so that the next page can keep them too.
+ * The server samples without a prefilter, so views which shrink the
+ * decode more than twice are left to the mips of drawimage(), as are the
+ * filters it does not have. */
+typedef struct {
+    Node *image;
+    Pixmap pixmap;
+    Picture picture;    /* None when the server could not take the image */
+} Upload;
+
+static Upload *uploads;
+static int nuploads;
+static Bool renderfailed;
+
+static const char *renderfilters[] = {
+    [Nearest] = FilterNearest,
+    [Bilinear] = FilterBilinear,
+};
+
+/* Another reference to a referenced image */
+static void
+cachehold(Node *image) {
+    Cached *c;
+
+    pthread_mutex_lock(&joblock);
+    if(!(c = cachedimage(image)))
+        die("BUG: holding an image which is not cached\n");
+    cacheref(c);
+    pthread_mutex_unlock(&joblock);
+}
+
+static int
+rendererror(Display *dpy, XErrorEvent *e) {
+    renderfailed = True;
+    return 0;
+}
+
+static void
+freeupload(Upload *u) {
+    if(!u->picture)
+        return;
+    XRenderFreePicture(dpy, u->picture);
+    XFreePixmap(dpy, u->pixmap);
+    u->picture = None;
+}
+
+static void
+dropuploads(void) {
+    int i;
+
+    for(i = 0; i < nuploads; i++) {
+        freeupload(&uploads[i]);
+        if(uploads[i].image)
+            cacherelease(uploads[i].image);
+    }
+    free(uploads);
+    uploads = NULL;
+    nuploads = 0;
+}
+
+/* Sends the pixels of image to the server, they are too large for it when
+ * u->picture stays None */
+static void
+upload(Node *image, Upload *u) {
+    XImage *img;
+    XErrorHandler handler;
+    XRenderPictureAttributes pa = { .repeat = RepeatPad };
+    unsigned char *buf = IMG(image).imagebuf, *expanded = NULL;
+    vec2 size = IMG(image).size;
+    TRACEBEGIN(span);
+
+    *u = (Upload){ .image = image };
+    if(size.x > SHRT_MAX || size.y > SHRT_MAX)
+        return;
+    if(PIXELSIZE(IMG(image).format) != 4) {
+        /* to 32 bits, at its own size */
+        if(!(expanded = poolget((size_t)size.x * size.y * 4)))
+            return;
+        resample(buf, size.x, size.y, size.x * PIXELSIZE(IMG(image).format), IMG(image).format,
+                (uint32_t *)expanded, size.x, size.x, size.y, Nearest);
+        buf = expanded;
+    }
+    img = XCreateImage(dpy, CopyFromParent, DefaultDepth(dpy, screen), ZPixmap, 0,
+            (char *)buf, size.x, size.y, 32, 0);
+    img->byte_order = IMG(image).format == XRGB32 ? MSBFirst : LSBFirst;
+
+    /* a pixmap the server has no memory for only shows as an X error */
+    renderfailed = False;
+    handler = XSetErrorHandler(rendererror);
+    u->pixmap = XCreatePixmap(dpy, win, size.x, size.y, DefaultDepth(dpy, screen));
+    XPutImage(dpy, u->pixmap, gc, img, 0, 0, 0, 0, size.x, size.y);
+    /* padded, so that the filter does not darken the edges */
+    u->picture = XRenderCreatePicture(dpy, u->pixmap, renderformat, CPRepeat, &pa);
+    XSync(dpy, False);
+    if(renderfailed) {
+        freeupload(u);
+        XSync(dpy, False);
+    }
+    XSetErrorHandler(handler);
+
+    img->data = NULL;
+    XDestroyImage(img);
+    poolput(expanded);
+    TRACEEND(span, "upload");
+}
+
+/* Composites curnode into the back buffer with its top left at pos, and
+ * shows it. Returns 0 when an image of it is not on the server, or the
+ * server would not scale it as drawimage() does. */
+static int
+renderpage(vec2 pos, double ratio) {
+    Upload *kept;
+    Node *imgnode;
+    XTransform t = {{{ 0 }}};
+    XRenderColor black = { .alpha = 0xffff };
+    vec2 imgsize;
+    int i, j, x0, y0, x1, y1, count = PG(curnode).count;
+    TRACEBEGIN(span);
+
+    if(filter >= LENGTH(renderfilters))
+        return 0;
+    for(i = 0; i < count; i++) {
+        imgsize = vec2_scale(IMG(PG(curnode).images[i]).full, ratio);
+        if(2 * imgsize.x < IMG(PG(curnode).images[i]).size.x ||
+                2 * imgsize.y < IMG(PG(curnode).images[i]).size.y)
+            return 0;
+    }
+
+    /* images which stay on the page keep their uploads */
+    if(!(kept = calloc(count, sizeof(Upload))))
+        die("Failed to allocate memory on rendering\n");
+    for(i = 0; i < count; i++)
+        for(j = 0; j < nuploads; j++)
+            if(uploads[j].image == PG(curnode).images[i]) {
+                kept[i] = uploads[j];
+                uploads[j] = (Upload){ 0 };
+                break;
+            }
+    dropuploads();
+    uploads = kept;
+    nuploads = count;
+    for(i = 0; i < count; i++)
+        if(!uploads[i].image) {
+            cachehold(PG(curnode).images[i]);
+            upload(PG(curnode).images[i], &uploads[i]);
+        }
+    for(i = 0; i < count; i++)
+        if(!uploads[i].picture)
+            return 0;
+
+    createbackbuf(viewsize);
+    XRenderFillRectangle(dpy, PictOpSrc, backpict, &black, 0, 0, viewsize.x, viewsize.y);
+    t.matrix[2][2] = XDoubleToFixed(1);
+    for(i = 0; i < count; i++, pos.x += imgsize.x) {
+        imgnode = PG(curnode).images[i];
+        imgsize = vec2_scale(IMG(imgnode).full, ratio);
+        x0 = MAX(pos.x, 0);
+        x1 = MIN(pos.x + imgsize.x, viewsize.x);
+        y0 = MAX(pos.y, 0);
+        y1 = MIN(pos.y + imgsize.y, viewsize.y);
+        if(x0 >= x1 || y0 >= y1)
+            continue;
+        /* from the view to the pixels of the decode */
+        t.matrix[0][0] = XDoubleToFixed((double)IMG(imgnode).size.x / imgsize.x);
+        t.matrix[1][1] = XDoubleToFixed((double)IMG(imgnode).size.y / imgsize.y);
+        XRenderSetPictureTransform(dpy, uploads[i].picture, &t);
+        XRenderSetPictureFilter(dpy, uploads[i].picture, renderfilters[filter], NULL, 0);
+        XRenderComposite(dpy, PictOpSrc, uploads[i].picture, None, backpict,
+                x0 - pos.x, y0 - pos.y, 0, 0, x0, y0, x1 - x0, y1 - y0);
+    }
+    showframe();
+    XFlush(dpy);
+    TRACEEND(span, "composite");
+    return 1;
+}
+#endif
+
+/* Halved copies of a decoded image, for views which shrink it more than
+ * twice. They are made MIP_TILE squares at a time, only where a view
+ * needs them, level k in mips[k - 1]. */
+struct Mip {
+    unsigned char *buf;
+    vec2 size, tiles;
+    unsigned char *made;    /* per tile */
+};
+
+static vec2
+mipsize(Node *image, int level) {
+    vec2 size = IMG(image).size;
+
+    for(; level > 0; level--)
+        size = (vec2){ .x = (size.x + 1) / 2, .y = (size.y + 1) / 2 };
+    return size;
+}
+
+static const unsigned char *
+mipbuf(Node *image, int level, int *stride) {
+    Mip *m;
+    int i, pixelsize = PIXELSIZE(IMG(image).format);
+    size_t bytes = 0;
+
+    if(!level) {
+        *stride = IMG(image).size.x * pixelsize;
+        return IMG(image).imagebuf;
+    }
+    if(level > IMG(image).nmips) {
+        if(!(IMG(image).mips = realloc(IMG(image).mips, level * sizeof(Mip))))
+            die("Failed to allocate memory on zooming\n");
+        for(i = IMG(image).nmips; i < level; i++) {
+            m = &IMG(image).mips[i];
+            m->size = mipsize(image, i + 1);
+            m->tiles = (vec2){ .x = (m->size.x + MIP_TILE - 1) / MIP_TILE,
+                               .y = (m->size.y + MIP_TILE - 1) / MIP_TILE };
+            if(!(m->buf = poolget((size_t)m->size.x * m->size.y * pixelsize)) ||
+                    !(m->made = calloc((size_t)m->tiles.x * m->tiles.y, 1)))
+                die("Failed to allocate memory on zooming\n");
+            bytes += (size_t)m->size.x * m->size.y * pixelsize;
+        }
+        IMG(image).nmips = level;
+        cachegrow(image, bytes);
+    }
+    *stride = IMG(image).mips[level - 1].size.x * pixelsize;
+    return IMG(image).mips[level - 1].buf;
+}
+
+/* Makes the tiles of a level under x0, y0 to x1, y1, from the level below */
+static void
+mipmake(Node *image, int level, int x0, int y0, int x1, int y1) {
+    const unsigned char *below, *a, *b;
+    unsigned char *dst;
+    int tx, ty, x, y, ch, xa, xb, stride, sstride, pixelsize = PIXELSIZE(IMG(image).format);
+    vec2 lo, hi, size;
+    Mip *m;
+
+    if(!level)
+        return;
+    mipbuf(image, level, &stride);
+    m = &IMG(image).mips[level - 1];
+    size = mipsize(image, level - 1);
+    for(ty = y0 / MIP_TILE; ty <= (y1 - 1) / MIP_TILE; ty++)
+        for(tx = x0 / MIP_TILE; tx <= (x1 - 1) / MIP_TILE; tx++) {
+            if(m->made[ty * m->tiles.x + tx])
+                continue;
+            lo = (vec2){ .x = tx * MIP_TILE, .y = ty * MIP_TILE };
+            hi = (vec2){ .x = MIN(lo.x + MIP_TILE, m->size.x), .y = MIN(lo.y + MIP_TILE, m->size.y) };
+            mipmake(image, level - 1, 2 * lo.x, 2 * lo.y, MIN(2 * hi.x, size.x), MIN(2 * hi.y, size.y));
+            below = mipbuf(image, level - 1, &sstride);
+
+            /* each pixel averages two by two of the level below, the
+             * last ones of odd sizes repeat */
+            for(y = lo.y; y < hi.y; y++) {
+                a = below + (size_t)2 * y * sstride;
+                b = below + (size_t)MIN(2 * y + 1, size.y - 1) * sstride;
+                dst = m->buf + (size_t)y * stride + lo.x * pixelsize;
+                for(x = lo.x; x < hi.x; x++) {
+                    xa = 2 * x * pixelsize;
+                    xb = MIN(2 * x + 1, size.x - 1) * pixelsize;
+                    for(ch = 0; ch < pixelsize; ch++)
+                        *dst++ = (a[xa + ch] + a[xb + ch] + b[xa + ch] + b[xb + ch] + 2) >> 2;
+                }
+            }
+            m->made[ty * m->tiles.x + tx] = 1;
+        }
+}
+
+/* Draws the w * h window at x, y of image scaled to size at fx, fy of the
+ * frame, from the smallest level still as large as size */
+static void
+drawimage(Node *image, vec2 size, int x, int y, int w, int h, int fx, int fy) {
+    const unsigned char *buf;
+    int level = 0, stride, x0, y0, x1, y1;
+    vec2 src = IMG(image).size, next;
+
+    for(;; level++, src = next) {
+        next = mipsize(image, level + 1);
+        if(next.x < size.x || next.y < size.y || (next.x == src.x && next.y == src.y))
+            break;
+    }
+    /* the source under the window, with room for the filter */
+    x0 = MAX((int)((double)x * src.x / size.x) - MIP_MARGIN, 0);
+    y0 = MAX((int)((double)y * src.y / size.y) - MIP_MARGIN, 0);
+    x1 = MIN((int)((double)(x + w) * src.x / size.x) + MIP_MARGIN + 1, src.x);
+    y1 = MIN((int)((double)(y + h) * src.y / size.y) + MIP_MARGIN + 1, src.y);
+    mipmake(image, level, x0, y0, x1, y1);
+    buf = mipbuf(image, level, &stride);
+
+    TRACEBEGIN(scale);
+    resamplerect(buf, src.x, src.y, stride, IMG(image).format,
+            (uint32_t *)(frame->data + (size_t)fy * frame->bytes_per_line) + fx,
+            frame->bytes_per_line / 4, size.x, size.y, x, y, w, h, filter);
+    TRACEEND(scale, "resample");
+}
+
+/* Size of the page in the view, and the ratio it is scaled by */
+static vec2
+pagesize(double *ratio) {
+    vec2 size = (vec2){.x = 0, .y = 0};
+    int i;
+
+    for(i = 0; i < PG(curnode).count; i++) {
+        size.x += IMG(PG(curnode).images[i]).full.x;
+        size.y = MAX(IMG(PG(curnode).images[i]).full.y, size.y);
+    }
+    if(vec2_ratio(size) > vec2_ratio(viewsize))
+        *ratio = (double)viewsize.x / size.x;
+    else
+        *ratio = (double)viewsize.y / size.y;
+    *ratio *= zoom;
+    return vec2_scale(size, *ratio);
+}
+
+/* Top left of the view on a page of size, clamping the center into it. A
+ * page smaller than the view is centered, at negative coordinates. */
+static int
+viewstart(double *center, int size, int view) {
+    int start;
+
+    if(size <= view) {
+        *center = .5;
+        return -(view - size) / 2;
+    }
+    start = MAX(MIN((int)(*center * size - view / 2), size - view), 0);
+    *center = (start + view / 2) / (double)size;
+    return start;
+}
+
+void
+render(void) {
+    if(curnode->type != Page)
+        die("BUG: curnode->type != Page on render(): %d", curnode->type);
+    if(gridmode) {
+        composited = False;
+        rendergrid();
+        return;
+    }
+
+    int i, x0, x1, y0, y1, left, top;
+    Node *imgnode;
+    vec2 canvas, pos, imgsize;
+    double ratio;
+    TRACEBEGIN(span);
+
+    /* the last page stays in view until a decode of this one is there */
+    refreshpage();
+    if(!pageready()) {
+        settitle();
+        TRACEEND(span, "render");
+        return;
+    }
+    /* top left of the page in the frame, only its part in the view is scaled */
+    canvas = pagesize(&ratio);
+    pos.x = -viewstart(&centerx, canvas.x, viewsize.x);
+    pos.y = -viewstart(&centery, canvas.y, viewsize.y);
+
+#ifdef XRENDER
+    if((composited = userender && renderpage(pos, ratio))) {
+        settitle();
+        TRACEEND(span, "render");
+        return;
+    }
+#endif
+    if (!createframe(viewsize))
+        die("Failed to create image\n");
+    left = MAX(pos.x, 0);
+    top = MAX(pos.y, 0);
+    clearframe(0, 0, viewsize.x, top);
+    clearframe(0, top, left, viewsize.y - top);
+    for(i = 0; i < PG(curnode).count; i++, pos.x += imgsize.x) {
+        imgnode = PG(curnode).images[i];
+        imgsize = vec2_scale(IMG(imgnode).full, ratio);
+        x0 = MAX(pos.x, 0);
+        x1 = MIN(pos.x + imgsize.x, viewsize.x);
+        y0 = top;
+        y1 = MAX(MIN(pos.y + imgsize.y, viewsize.y), y0);
+        if(x0 >= x1)
+            continue;
+        if(y0 < y1)
+            drawimage(imgnode, imgsize, x0 - pos.x, y0 - pos.y, x1 - x0, y1 - y0, x0, y0);
+        clearframe(x0, y1, x1 - x0, viewsize.y - y1);
+        left = x1;
+    }
+    clearframe(left, top, viewsize.x - left, viewsize.y - top);
+
+    putframe();
+
+    settitle();
+    TRACEEND(span, "render");
+}
+
+static void
+settitle(void) {
+    TRACEBEGIN(span);
+    char *title = gentitle(curnode);
+    xsettitle(win, title);
+    free(title);
+    TRACEEND(span, "gentitle");
+}
+
+/* Grid overview: GRID_SIZE thumbnails of the entries of the container of
+ * curnode, scrolled to keep the selected one in view */
+static vec2
+gridcells(void) {
+    int cell = GRID_SIZE + GRID_GAP;
+    return (vec2){ .x = MAX(viewsize.x / cell, 1), .y = MAX(viewsize.y / cell, 1) };
+}
+
+static void
+fillframe(int x, int y, int w, int h, int gray) {
+    char *row = frame->data + (size_t)y * frame->bytes_per_line + x * 4;
+
+    for(; w > 0 && h > 0; h--, row += frame->bytes_per_line)
+        memset(row, gray, (size_t)w * 4);
+}
+
+void
+rendergrid(void) {
+    Node *container = curnode->parent;
+    int i, y, idx, count, first, shown, cell = GRID_SIZE + GRID_GAP;
+    vec2 cells = gridcells(), origin, pos;
+    ThumbSlot *slot;
+    char *title;
+    TRACEBEGIN(span);
+
+    position(container, &idx, &count);
+    gridsel = MAX(MIN(gridsel, count - 1), 0);
+    if(gridsel < gridtop * cells.x)
+        gridtop = gridsel / cells.x;
+    else if(gridsel >= (gridtop + cells.y) * cells.x)
+        gridtop = gridsel / cells.x - cells.y + 1;
+    first = gridtop * cells.x;
+    /* a window smaller than a cell shows none */
+    shown = viewsize.x >= cell && viewsize.y >= cell ? cells.x * cells.y : 0;
+
+    if(!createframe(viewsize))
+        die("Failed to create image\n");
+    clearframe(0, 0, viewsize.x, viewsize.y);
+    origin = (vec2){ .x = (viewsize.x - cells.x * cell + GRID_GAP) / 2,
+                     .y = (viewsize.y - cells.y * cell + GRID_GAP) / 2 };
+
+    pthread_mutex_lock(&joblock);
+    for(i = first; i < MIN(first + shown, count); i++) {
+        pos = vec2_add(origin, (vec2){ .x = (i - first) % cells.x * cell,
+                                       .y = (i - first) / cells.x * cell });
+        if(i == gridsel)
+            fillframe(MAX(pos.x - GRID_GAP / 2, 0), MAX(pos.y - GRID_GAP / 2, 0),
+                    cell, cell, GRID_SELECTION);
+        slot = thumbslot(container, i);
+        if(!thumbmade(container, i)) {
+            fillframe(pos.x, pos.y, GRID_SIZE, GRID_SIZE, GRID_MISSING);
+            thumbqueue(container, i);
+            continue;
+        }
+        if(slot->w == THUMB_NONE)
+            continue;
+        pos = vec2_add(pos, (vec2){ .x = (GRID_SIZE - slot->w) / 2, .y = (GRID_SIZE - slot->h) / 2 });
+        for(y = 0; y < slot->h; y++)
+            memcpy(frame->data + (size_t)(pos.y + y) * frame->bytes_per_line + pos.x * 4,
+                    (uint32_t *)(slot + 1) + y * slot->w, slot->w * 4);
+    }
+    /* and the screen after, for scrolling on */
+    for(; i < MIN(first + 2 * shown, count); i++)
+        if(!thumbmade(container, i))
+            thumbqueue(container, i);
+    pthread_cond_broadcast(&jobcond);
+    pthread_mutex_unlock(&joblock);
+
+    putframe();
+    asprintf(&title, "%s [%d/%d] %s", wmname, gridsel + 1, count, entryname(container, gridsel));
+    xsettitle(win, title);
+    free(title);
+    TRACEEND(span, "rendergrid");
+}
+
+void
+togglegrid(const Arg *arg) {
+    Node *container = curnode->parent;
+    int idx, count;
+
+    if(!gridmode && arg->i < 0)
+        return;
+    gridmode = !gridmode;
+    if(gridmode) {
+        if(!container->thumbs)
+            openthumbs(container);
+        position(container, &idx, &count);
+        gridsel = idx - PG(curnode).count;
+    } else
+        prefetch();
+    dirty = 1;
+}
+
 void
-render(void) {
-    if(curnode->type != Page)
-        die("BUG: curnode->type != Page on render(): %d", curnode->type);
+gridmove(const Arg *arg) {
+    if(!gridmode)
+        return;
+    gridsel += arg->i;
+    dirty = 1;
+}
 
-    int i;
-    Node *imgnode;
-    XImage *img;
-    vec2 anchor, imgsize, size = (vec2){.x=0, .y=0};
+void
+gridrow(const Arg *arg) {
+    if(!gridmode)
+        return;
+    gridsel += arg->i * gridcells().x;
+    dirty = 1;
+}
 
-    for(i = 0; i < PG(curnode).count; i++) {
-        imgnode = PG(curnode).images[i];
-        size.x += IMG(imgnode).size.x;
-        size.y = MAX(IMG(imgnode).size.y, size.y);
-    }
+/* Leaves the grid for the page of the selected entry */
+void
+gridselect(const Arg *arg) {
+    int idx, count, page;
 
-    double resizeratio;
-    if(vec2_ratio(size) > vec2_ratio(viewsize))
-        resizeratio = (double)viewsize.x / size.x;
-    else
-        resizeratio = (double)viewsize.y / size.y;
-
-    XClearArea(dpy, win, 0, 0, 0, 0, False);
-    anchor = vec2_scale(vec2_add(viewsize, vec2_scale(size, -resizeratio)), .5f);
-    for(i = 0; i < curnode->u.page.count; i++) {
-        imgnode = curnode->u.page.images[i];
-        imgsize = vec2_scale(IMG(imgnode).size, resizeratio);
-        if (!(img = createimage(imgnode, imgsize)))
-            die("Failed to create image\n");
-
-        XPutImage (dpy, win, gc, img, 0, 0, anchor.x, anchor.y, imgsize.x, imgsize.y);
-        anchor.x += imgsize.x;
-        XDestroyImage(img);
-    }
-    XFlush (dpy);
+    if(!gridmode)
+        return;
+    gridmode = 0;
+    pendingpage = INT_MIN;
+    position(curnode->parent, &idx, &count);
+    seekdir = gridsel < idx - PG(curnode).count ? -1 : 1;
+    /* the entry by its page among all inputs, once they are counted */
+    if((page = globalpage()) >= 0 && seekpage(page - (idx - PG(curnode).count) + gridsel))
+        return;
+    moveoffset(gridsel - idx + imageperpage);
+}
 
-    char *title = gentitle(curnode);
-    xsettitle(win, title);
-    free(title);
+/* Selects the cell under x, y, and enters it when it was selected */
+static void
+gridclick(int x, int y) {
+    int cell = GRID_SIZE + GRID_GAP, i, idx, count;
+    vec2 cells = gridcells();
+
+    x -= (viewsize.x - cells.x * cell + GRID_GAP) / 2 - GRID_GAP / 2;
+    y -= (viewsize.y - cells.y * cell + GRID_GAP) / 2 - GRID_GAP / 2;
+    if(x < 0 || y < 0 || x / cell >= cells.x || y / cell >= cells.y)
+        return;
+    i = (gridtop + y / cell) * cells.x + x / cell;
+    position(curnode->parent, &idx, &count);
+    if(i >= count)
+        return;
+    if(i == gridsel)
+        gridselect(NULL);
+    else {
+        gridsel = i;
+        dirty = 1;
+    }
 }
 
 void
@@ -564,47 +3869,129 @@ buttonpress(XEvent *e) {
     XButtonPressedEvent *ev = &e->xbutton;
     int side = (ev->x > viewsize.x / 2) + 1;
 
+    if(gridmode && ev->button == Button1) {
+        gridclick(ev->x, ev->y);
+        return;
+    }
     for(i = 0; i < LENGTH(buttons); i++)
         if(buttons[i].func && buttons[i].button == ev->button
                 && CLEANMASK(buttons[i].mask) == CLEANMASK(ev->state)
-                && side & buttons[i].side)
+                && side & buttons[i].side) {
+            if(buttons[i].func != seek)
+                flushseek();
             buttons[i].func(&buttons[i].arg);
+        }
 }
 
+static long
+msnow(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* An interactive resize sends these one after the other, only the size
+ * they settle on is rendered unless the server scales the page */
 void
 configurenotify(XEvent *e) {
     XConfigureEvent xce = e->xconfigure;
+
+    if(xce.width == viewsize.x && xce.height == viewsize.y)
+        return;
     viewsize = (vec2){.x = xce.width, .y = xce.height};
-    render();
+    if(composited)
+        dirty = 1;
+    else
+        resized = msnow();
 }
 
 void
 expose(XEvent *e) {
-    if((&e->xexpose)->count)
-        render();
+    XExposeEvent *ev = &e->xexpose;
+    XRectangle r = { .x = ev->x, .y = ev->y, .width = ev->width, .height = ev->height };
+
+    if(!backbuf) {
+        dirty = 1;
+        return;
+    }
+    if(!damage)
+        damage = XCreateRegion();
+    XUnionRectWithRegion(&r, damage, damage);
 }
 
 void
 run(void) {
     XEvent ev;
-    /* main event loop */
+    char buf[64];
+    int wait;
+    struct pollfd fds[] = {
+        { .fd = ConnectionNumber(dpy), .events = POLLIN },
+        { .fd = wakefd[0], .events = POLLIN },
+    };
+
+    /* main event loop, woken by X events and by finished decodes. Handlers
+     * only mark the frame dirty, it is rendered once when the queued events
+     * are handled. Exposures are copied from the back buffer. */
     XSync(dpy, False);
-    while(running && !XNextEvent(dpy, &ev))
-        if(handler[ev.type])
-            handler[ev.type](&ev); /* call handler */
+    while(running) {
+        while(running && XPending(dpy)) {
+            XNextEvent(dpy, &ev);
+            if(handler[ev.type])
+                handler[ev.type](&ev); /* call handler */
+        }
+        if(!running)
+            break;
+        flushseek();
+        wait = -1;
+        if(resized && (wait = resized + RESIZE_DELAY - msnow()) <= 0) {
+            resized = 0;
+            wait = -1;
+            dirty = 1;
+        }
+        if(dirty && !resized) {
+            dirty = 0;
+            render();
+        }
+        /* also while resizing, from the frame of the old size */
+        if(damage)
+            repaint();
+        /* rendering may have read events already */
+        if(XPending(dpy))
+            continue;
+        if(poll(fds, LENGTH(fds), wait) == -1 && errno != EINTR)
+            die("Failed to poll: %s\n", strerror(errno));
+        if(fds[1].revents & POLLIN) {
+            while(read(wakefd[0], buf, sizeof(buf)) > 0);
+            /* new thumbnails, better images of the page, or files listed */
+            if(gridmode || refreshpage())
+                dirty = 1;
+            else if(dirupdate() | indexupdate())
+                settitle();
+        }
+    }
 }
 
 void
 cleanupnode(Node *node) {
     int i;
-    if(node->type == Image)
-        free(IMG(node).imagebuf);
-    else if(node->type == Page) {
+    if(node->type == Image) {
+        poolput(IMG(node).imagebuf);
+        for(i = 0; i < IMG(node).nmips; i++) {
+            poolput(IMG(node).mips[i].buf);
+            free(IMG(node).mips[i].made);
+        }
+        free(IMG(node).mips);
+    } else if(node->type == Page) {
         for(i = 0; i < PG(node).count; i++)
-            cleanupnode(PG(node).images[i]);
+            if(PG(node).images[i])
+                cacherelease(PG(node).images[i]);
         free(PG(node).images);
-    } else if(node->cleanup) {
-        node->cleanup(node);
+    } else {
+        prefetchcancel(node);
+        closethumbs(node);
+        if(node->cleanup)
+            node->cleanup(node);
     }
 
     free(node->name);
@@ -614,13 +4001,35 @@ cleanupnode(Node *node) {
 
 void
 cleanup(void) {
+    int i;
+    Job *job;
     Node *node;
+
+    freeindex();
+    pthread_mutex_lock(&joblock);
+    pthread_cond_broadcast(&jobcond);
+    pthread_mutex_unlock(&joblock);
+    for(i = 0; i < LENGTH(workers); i++)
+        pthread_join(workers[i], NULL);
+    while((job = jobs)) {
+        jobs = job->next;
+        free(job);
+    }
+
+#ifdef XRENDER
+    dropuploads();
+#endif
     while(curnode) {
         node = curnode->parent;
         cleanupnode(curnode);
         curnode = node;
     }
+    cachelimit = 0;
+    cacheevict();
 
+    close(wakefd[0]);
+    close(wakefd[1]);
+    destroyframe();
     XFreeGC(dpy, gc);
     XDestroyWindow(dpy, win);
     XCloseDisplay(dpy);
@@ -631,9 +4040,130 @@ quit(const Arg *arg) {
     running = False;
 }
 
+/* Number of the first image of the page among the pages of all inputs, -1
+ * while the inputs up to it are not all counted */
+int
+globalpage(void) {
+    Node *c, *root;
+    Input *in;
+    int idx, count, input, page = 0;
+
+    if(!pageindex || curnode->type != Page)
+        return -1;
+    root = pageindex->root;
+    c = curnode->parent;
+    position(c, &idx, &count);
+    idx -= PG(curnode).count;
+    input = c == root ? idx : FL(root).idx;
+
+    pthread_mutex_lock(&pageindex->lock);
+    if(input >= pageindex->known) {
+        pthread_mutex_unlock(&pageindex->lock);
+        return -1;
+    }
+    in = &pageindex->inputs[input];
+    if(c->type == Directory)
+        page = in->files[MIN(idx, in->nfiles)];
+    else if(c != root) {
+        /* an archive, in a directory or not */
+        page = idx;
+        if(c->parent->type == Directory)
+            page += in->files[MIN(FL(c->parent).idx, in->nfiles)];
+    }
+    page += pageindex->first[input];
+    pthread_mutex_unlock(&pageindex->lock);
+    return page;
+}
+
+/* Shows a page of all inputs, negative ones counted back from the last.
+ * Only the containers not holding it are closed, so that their decodes
+ * stay cached. Returns 0 while the inputs up to it are not all counted. */
+static int
+seekpage(int page) {
+    Index *ix = pageindex;
+    Node *n, *root;
+    Input *in;
+    int lo, hi, mid, input, file = -1;
+
+    if(!ix)
+        return 0;
+    pthread_mutex_lock(&ix->lock);
+    if(ix->known == ix->count && !ix->first[ix->count]) {
+        pthread_mutex_unlock(&ix->lock);
+        return 1;
+    }
+    if(ix->known == ix->count)
+        page = MIN(page < 0 ? ix->first[ix->count] + page : page, ix->first[ix->count] - 1);
+    if(page < 0 ? ix->known < ix->count : page >= ix->first[ix->known]) {
+        pthread_mutex_unlock(&ix->lock);
+        return 0;
+    }
+    page = MAX(page, 0);
+    /* the last input starting at or before it, inputs without pages start
+     * where the next one does */
+    for(lo = 0, hi = ix->known - 1; lo < hi;) {
+        mid = (lo + hi + 1) / 2;
+        if(ix->first[mid] <= page)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    input = lo;
+    page -= ix->first[input];
+    in = &ix->inputs[input];
+    if(in->files) {
+        for(lo = 0, hi = in->nfiles - 1; lo < hi;) {
+            mid = (lo + hi + 1) / 2;
+            if(in->files[mid] <= page)
+                lo = mid;
+            else
+                hi = mid - 1;
+        }
+        file = lo;
+        page -= in->files[file];
+    }
+    pthread_mutex_unlock(&ix->lock);
+
+    root = ix->root;
+    while(curnode != root && (curnode->type == Page || FL(root).idx != input ||
+            (curnode->type == Archive && curnode->parent != root && FL(curnode->parent).idx != file))) {
+        n = curnode;
+        curnode = curnode->parent;
+        cleanupnode(n);
+    }
+    if(curnode == root) {
+        FL(root).idx = input;
+        if((n = opencontainer(root)))
+            curnode = n;
+    }
+    if(curnode->type == Directory && file >= 0) {
+        dirwait(curnode, file + 1);
+        FL(curnode).idx = MIN(file, FL(curnode).count - 1);
+        if((n = opencontainer(curnode)))
+            curnode = n;
+    }
+#ifdef ARCHIVE
+    if(curnode->type == Archive)
+        AR(curnode).idx = MIN(page, MAX(AR(curnode).count - 1, 0));
+#endif
+
+    centerx = centery = 0;
+    loadnext();
+    prefetch();
+    dirty = 1;
+    return 1;
+}
+
 int
 moveoffset(int offset) {
     Node *node = curnode;
+    int page;
+
+    /* across inputs, once they are counted. Forward seeks start after
+     * the page, which is short at the end of an input. */
+    if((page = globalpage()) >= 0 && seekpage(MAX(page + offset +
+            (offset > 0 ? PG(curnode).count - imageperpage : 0), 0)))
+        return 0;
     switch(node->type) {
     case Image:
         die("Image on moveoffset()");
@@ -643,6 +4173,9 @@ moveoffset(int offset) {
         return moveoffset(offset);
 
 
+    case Directory:
+        dirwait(node, FL(node).idx + offset - imageperpage + 1);
+        /* fall through */
     case FileList:
         // BUG: At the end of the file, same file opened twice.
         // It does not be a problem if file is an image, but
@@ -658,21 +4191,106 @@ moveoffset(int offset) {
         }
     }
 
+    /* a zoomed page is read from its top left */
+    centerx = centery = 0;
     loadnext();
-    render();
+    prefetch();
+    dirty = 1;
     return 0;
 }
 
 void
 seek(const Arg *arg) {
-    moveoffset(arg->i * imageperpage);
+    if(gridmode) {
+        gridmove(arg);
+        return;
+    }
+    pendingpage = INT_MIN;
+    pendingseek += arg->i * imageperpage;
+}
+
+/* Does the seeks queued since the last one at once, key repeat skips
+ * pages without loading them */
+static void
+flushseek(void) {
+    int offset = pendingseek;
+
+    if(pendingpage != INT_MIN && seekpage(pendingpage))
+        pendingpage = INT_MIN;
+    if(!offset)
+        return;
+    pendingseek = 0;
+    seekdir = offset < 0 ? -1 : 1;
+    moveoffset(offset);
 }
 
+/* Page arg->i of all inputs counted from 0, negative ones back from the
+ * last, or that entry of the grid */
 void
 seekabs(const Arg *arg) {
+    int idx, count;
+
+    if(gridmode) {
+        position(curnode->parent, &idx, &count);
+        gridsel = arg->i < 0 ? count + arg->i : arg->i;
+        dirty = 1;
+        return;
+    }
+    seekdir = arg->i < 0 ? -1 : 1;
+    pendingseek = 0;
+    pendingpage = arg->i;
+}
+
+/* Moves by arg->i images rather than pages, which realigns the spreads of
+ * double page mode */
+void
+shiftimage(const Arg *arg) {
+    if(gridmode)
+        return;
+    seekdir = arg->i < 0 ? -1 : 1;
+    pendingpage = INT_MIN;
     moveoffset(arg->i);
 }
 
+void
+cyclefilter(const Arg *arg) {
+    filter = (filter + arg->i + FilterLast) % FilterLast;
+    dirty = 1;
+}
+
+/* In or out by ZOOM_STEP, or back to fit the view for 0 */
+void
+zoomview(const Arg *arg) {
+    if(gridmode)
+        return;
+    if(!arg->i)
+        zoom = 1;
+    else
+        zoom = MAX(MIN(arg->i > 0 ? zoom * ZOOM_STEP : zoom / ZOOM_STEP, ZOOM_MAX), 1);
+    dirty = 1;
+}
+
+/* Moves the view PAN_STEP of its size over a zoomed page */
+void
+panx(const Arg *arg) {
+    double ratio;
+
+    if(gridmode || zoom == 1 || !pageready())
+        return;
+    centerx += arg->i * PAN_STEP * viewsize.x / pagesize(&ratio).x;
+    dirty = 1;
+}
+
+void
+pany(const Arg *arg) {
+    double ratio;
+
+    if(gridmode || zoom == 1 || !pageready())
+        return;
+    centery += arg->i * PAN_STEP * viewsize.y / pagesize(&ratio).y;
+    dirty = 1;
+}
+
 void
 keypress(XEvent *e) {
     unsigned int i;
@@ -684,8 +4302,12 @@ keypress(XEvent *e) {
     for(i = 0; i < LENGTH(keys); i++)
         if(keysym == keys[i].keysym
         && CLEANMASK(keys[i].mod) == CLEANMASK(ev->state)
-        && keys[i].func)
+        && keys[i].func) {
+            /* the others see the page the queued seeks lead to */
+            if(keys[i].func != seek)
+                flushseek();
             keys[i].func(&(keys[i].arg));
+        }
 }
 
 void
@@ -701,23 +4323,487 @@ xsettitle(Window w, const char *str) {
 
 void
 setup(void) {
+    int i;
+#ifdef XRENDER
+    int event, error;
+#endif
+
     dpy = XOpenDisplay(NULL);
     screen = DefaultScreen(dpy);
-    win = createwindow (dpy, screen, 0, 0, 800, 600);
+    viewsize = (vec2){.x = 800, .y = 600};
+    win = createwindow (dpy, screen, 0, 0, viewsize.x, viewsize.y);
     gc = XCreateGC (dpy, win, 0, NULL);
+    /* copies from the back buffer never need exposures of their own */
+    XSetGraphicsExposures(dpy, gc, False);
 
     if(DefaultDepth(dpy, screen) < 24)
         die("This program does not support displays with a depth less than 24\n");
+    useshm = XShmQueryExtension(dpy) && !getenv("COMIC_NOSHM");
+#ifdef XRENDER
+    userender = XRenderQueryExtension(dpy, &event, &error) && !getenv("COMIC_NORENDER") &&
+        (renderformat = XRenderFindVisualFormat(dpy, DefaultVisual(dpy, screen)));
+#endif
+#ifdef JCS_EXTENSIONS
+    /* only decoders writing XRGB32 can follow the server, RGB24 resamples to BGRX32 */
+    if(ImageByteOrder(dpy) == MSBFirst)
+        pixelformat = XRGB32;
+#endif
 
     XMapRaised(dpy, win);
     XSelectInput(dpy, win, ExposureMask | StructureNotifyMask | KeyPressMask | ButtonPressMask);
 
+    if(pipe(wakefd) == -1)
+        die("Failed to create pipe: %s\n", strerror(errno));
+    for(i = 0; i < 2; i++)
+        fcntl(wakefd[i], F_SETFL, O_NONBLOCK);
+
+    for(i = 0; i < LENGTH(workers); i++)
+        if(pthread_create(&workers[i], NULL, prefetchworker, NULL))
+            die("Failed to create prefetch worker\n");
+
+    indexinputs(node);
     loadnext();
+    prefetch();
+}
+
+#ifdef BENCH
+#include "bench.c"
+#else
+/* Headless thumbnails, comic -T: every page of the inputs is decoded at
+ * the smallest DCT scale covering a cell and scaled into a contact sheet
+ * per input, or into a file of its own without sheet columns. The loose
+ * images under a directory get a sheet of their own. Pages are split in
+ * contiguous runs over one worker per core, a worker out of pages steals
+ * the back half of the longest run left. The pages of an archive
+ * read only forward are one item of a run, so that one worker reads them
+ * in order. Pages which fail to decode are reported and left blank.
+ * An archive is open and a sheet allocated only from its first page
+ * taken to its last page done. */
+typedef struct {
+    Node *container;
+    const char *path;   /* of an archive, opened at its first page */
+    char *out;
+    char **pageouts;    /* of loose images written alone */
+    uint32_t *pixels;
+    int count, rows, left;
+    int opened, sequential;
+    pthread_mutex_t lock;
+} Sheet;
+
+typedef struct {
+    Sheet *sheet;
+    int idx, count;     /* pages from idx */
+} Thumb;
+
+typedef struct {
+    pthread_mutex_t lock;
+    int lo, hi;     /* thumbs not taken yet */
+} Run;
+
+static char *thumbdir;
+static int sheetcolumns = SHEET_COLUMNS;
+static Thumb *thumbs;
+static Run *runs;
+static int nruns;
+static char **outs;
+static int nouts;
+static Sheet *sheets;
+static int nsheets;
+static pthread_mutex_t sheetlock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Path in thumbdir, without .jpg, named after the file without its
+ * extension. Names taken by earlier files get -2, -3 and so on. */
+static char *
+thumbout(const char *filename) {
+    const char *base, *dot;
+    int i, n, len = strlen(filename);
+    char *path = NULL;
+
+    for(; len > 1 && filename[len - 1] == '/'; len--);
+    for(base = filename + len; base > filename && base[-1] != '/'; base--);
+    for(dot = filename + len; dot > base && *dot != '.'; dot--);
+    len = dot > base ? dot - base : filename + len - base;
+
+    for(n = 1, i = 0; !path || i < nouts; n++) {
+        free(path);
+        if(n == 1)
+            asprintf(&path, "%s/%.*s", thumbdir, len, base);
+        else
+            asprintf(&path, "%s/%.*s-%d", thumbdir, len, base, n);
+        for(i = 0; i < nouts && strcmp(outs[i], path); i++);
+    }
+    if(!(outs = realloc(outs, (nouts + 1) * sizeof(char *))))
+        die("Failed to allocate memory on thumbnails\n");
+    return outs[nouts++] = path;
+}
+
+static void
+writejpeg(const char *path, const uint32_t *pixels, int w, int h) {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr err_mgr;
+    JSAMPROW row;
+    const unsigned char *p;
+    FILE *f;
+    int x, y;
+
+    if(!(f = fopen(path, "wb")))
+        die("Failed to create %s: %s\n", path, strerror(errno));
+    cinfo.err = jpeg_std_error(&err_mgr);
+    err_mgr.error_exit = jpegerrorexit;
+    jpeg_create_compress(&cinfo);
+    jpeg_stdio_dest(&cinfo, f);
+    cinfo.image_width = w;
+    cinfo.image_height = h;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, THUMB_QUALITY, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    row = malloc((size_t)w * 3);
+    for(y = 0; y < h; y++) {
+        p = (const unsigned char *)(pixels + (size_t)y * w);
+        for(x = 0; x < w; x++, p += 4) {
+            /* the frame layout, 0x00rrggbb in either byte order */
+            row[x * 3] = pixelformat == XRGB32 ? p[1] : p[2];
+            row[x * 3 + 1] = pixelformat == XRGB32 ? p[2] : p[1];
+            row[x * 3 + 2] = pixelformat == XRGB32 ? p[3] : p[0];
+        }
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    free(row);
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    if(fclose(f))
+        die("Failed to write %s: %s\n", path, strerror(errno));
+}
+
+/* Writes a sheet in parts of at most JPEG_MAX_DIMENSION pixels high */
+static void
+writesheet(Sheet *sheet) {
+    int w = sheetcolumns * THUMB_SIZE, rows, part;
+    int partrows = JPEG_MAX_DIMENSION / THUMB_SIZE;
+    char *path;
+
+    for(part = 0; part * partrows < sheet->rows; part++) {
+        rows = MIN(sheet->rows - part * partrows, partrows);
+        if(sheet->rows <= partrows)
+            asprintf(&path, "%s.jpg", sheet->out);
+        else
+            asprintf(&path, "%s-part%d.jpg", sheet->out, part + 1);
+        writejpeg(path, sheet->pixels + (size_t)part * partrows * THUMB_SIZE * w,
+                w, rows * THUMB_SIZE);
+        printf("%s\n", path);
+        free(path);
+    }
+}
+
+/* Opens the archive of a sheet and allocates its pixels, once */
+static void
+opensheet(Sheet *sheet) {
+    size_t size = (size_t)sheetcolumns * THUMB_SIZE * sheet->rows * THUMB_SIZE * 4;
+#ifdef ARCHIVE
+    int type;
+#endif
+
+    pthread_mutex_lock(&sheet->lock);
+    if(sheet->opened) {
+        pthread_mutex_unlock(&sheet->lock);
+        return;
+    }
+    sheet->opened = 1;
+#ifdef ARCHIVE
+    if(sheet->path) {
+        sheet->container = sniffarchive(NULL, sheet->path, &type);
+        if(sheet->container && AR(sheet->container).count != sheet->count) {
+            cleanupnode(sheet->container);
+            sheet->container = NULL;
+        }
+        if(!sheet->container)
+            fprintf(stderr, "%s: failed to read the archive, skipped\n", sheet->path);
+    }
+#endif
+    if(sheetcolumns) {
+        if(!(sheet->pixels = malloc(size)))
+            die("Failed to allocate contact sheet of %s\n", sheet->out);
+        memset(sheet->pixels, THUMB_BACKGROUND, size);
+    }
+    pthread_mutex_unlock(&sheet->lock);
+}
+
+/* Scales page idx of a sheet into its cell, or writes it out alone */
+static void
+thumbpage(Sheet *sheet, int idx) {
+    vec2 cell = (vec2){ .x = THUMB_SIZE, .y = THUMB_SIZE }, size;
+    uint32_t *dst, *own = NULL;
+    char *name, *path;
+    int stride = 0, done;
+    double ratio;
+    Stream *s;
+    Node *image = NULL;
+    TRACEBEGIN(span);
+
+    opensheet(sheet);
+    if(sheet->container && (sheet->container->type != FileList ||
+                decoder(sniffile(FL(sheet->container).filenames[idx])) != -1) &&
+            (s = openentry(sheet->container, idx, &name))) {
+        image = imagenode(NULL, name, s, cell, 0);
+        closestream(s);
+        free(name);
+    }
+    if(!image && sheet->container) {
+        if(sheet->container->type == FileList)
+            fprintf(stderr, "%s: skipped\n", entryname(sheet->container, idx));
+        else
+            fprintf(stderr, "%s: %s: skipped\n", sheet->container->name, entryname(sheet->container, idx));
+    }
+
+    if(image) {
+        ratio = MIN((double)cell.x / IMG(image).full.x, (double)cell.y / IMG(image).full.y);
+        size = vec2_scale(IMG(image).full, ratio);
+        size.x = MIN(MAX(size.x, 1), cell.x);
+        size.y = MIN(MAX(size.y, 1), cell.y);
+        if(sheetcolumns) {
+            stride = sheetcolumns * cell.x;
+            dst = sheet->pixels + (size_t)(idx / sheetcolumns * cell.y + (cell.y - size.y) / 2) * stride
+                + idx % sheetcolumns * cell.x + (cell.x - size.x) / 2;
+        } else
+            dst = own = poolget((size_t)size.x * size.y * sizeof(uint32_t));
+        resample(IMG(image).imagebuf, IMG(image).size.x, IMG(image).size.y,
+                IMG(image).size.x * PIXELSIZE(IMG(image).format), IMG(image).format,
+                dst, sheetcolumns ? stride : size.x, size.x, size.y, filter);
+        cleanupnode(image);
+        if(own) {
+            if(sheet->pageouts)
+                asprintf(&path, "%s.jpg", sheet->pageouts[idx]);
+            else
+                asprintf(&path, "%s-%04d.jpg", sheet->out, idx + 1);
+            writejpeg(path, own, size.x, size.y);
+            free(path);
+            poolput(own);
+        }
+    }
+    TRACEEND(span, "thumbnail");
+
+    /* the last page done writes the sheet and lets go of it */
+    pthread_mutex_lock(&sheetlock);
+    done = !--sheet->left;
+    pthread_mutex_unlock(&sheetlock);
+    if(!done)
+        return;
+    if(sheetcolumns && sheet->container)
+        writesheet(sheet);
+    free(sheet->pixels);
+    sheet->pixels = NULL;
+    if(sheet->path && sheet->container) {
+        cleanupnode(sheet->container);
+        sheet->container = NULL;
+    }
+}
+
+static int
+takethumb(Run *r) {
+    int i = -1;
+
+    pthread_mutex_lock(&r->lock);
+    if(r->lo < r->hi)
+        i = r->lo++;
+    pthread_mutex_unlock(&r->lock);
+    return i;
+}
+
+static int
+runleft(Run *r) {
+    int left;
+
+    pthread_mutex_lock(&r->lock);
+    left = r->hi - r->lo;
+    pthread_mutex_unlock(&r->lock);
+    return left;
+}
+
+/* Moves the back half of the longest other run to the empty run r.
+ * Returns 0 once all runs are empty. */
+static int
+stealthumbs(Run *r) {
+    int i, lo, hi, left, most = 0;
+    Run *victim = NULL;
+
+    for(i = 0; i < nruns; i++)
+        if(&runs[i] != r && (left = runleft(&runs[i])) > most) {
+            most = left;
+            victim = &runs[i];
+        }
+    if(!victim)
+        return 0;
+
+    /* one lock at a time, thieves may steal from each other */
+    pthread_mutex_lock(&victim->lock);
+    hi = victim->hi;
+    lo = victim->hi -= (victim->hi - victim->lo + 1) / 2;
+    pthread_mutex_unlock(&victim->lock);
+    pthread_mutex_lock(&r->lock);
+    r->lo = lo;
+    r->hi = hi;
+    pthread_mutex_unlock(&r->lock);
+    return 1;
+}
+
+static void *
+thumbworker(void *arg) {
+    Run *r = arg;
+    int i, j;
+
+    for(;;) {
+        while((i = takethumb(r)) != -1)
+            for(j = 0; j < thumbs[i].count; j++)
+                thumbpage(thumbs[i].sheet, thumbs[i].idx + j);
+        if(!stealthumbs(r))
+            return NULL;
+    }
+}
+
+/* A sheet of the loose images in container, or of the archive at path */
+static Sheet *
+addsheet(Node *container, const char *path, int count, const char *name) {
+    Sheet *sheet;
+
+    if(!(sheets = realloc(sheets, (nsheets + 1) * sizeof(Sheet))))
+        die("Failed to allocate memory on thumbnails\n");
+    sheet = &sheets[nsheets++];
+    *sheet = (Sheet){ .container = container, .path = path, .count = count, .left = count };
+    /* the path of the sheet, or the prefix of the pages of an archive */
+    if(sheetcolumns || path)
+        sheet->out = thumbout(name);
+    if(sheetcolumns)
+        sheet->rows = (count + sheetcolumns - 1) / sheetcolumns;
+    return sheet;
+}
+
+/* A sheet for each archive of the files and one named name for the loose
+ * images among them */
+static void
+addfiles(char *const *files, int count, const char *name) {
+    char **imagenames = malloc(count * sizeof(char *));
+    Node *images;
+    int i, nimages = 0;
+#ifdef ARCHIVE
+    Node *archive;
+    Sheet *sheet;
+    int type;
+#endif
+
+    for(i = 0; i < count; i++) {
+#ifdef ARCHIVE
+        /* counted here, read again when its pages are made */
+        if((archive = sniffarchive(NULL, files[i], &type))) {
+            sheet = addsheet(NULL, files[i], AR(archive).count, files[i]);
+            sheet->sequential = AR(archive).kind == Sequential;
+            cleanupnode(archive);
+            continue;
+        }
+        if(type == FileArchive) {
+            fprintf(stderr, "%s: failed to read the archive, skipped\n", files[i]);
+            continue;
+        }
+#endif
+        imagenames[nimages++] = files[i];
+    }
+    if(!nimages) {
+        free(imagenames);
+        return;
+    }
+    images = malloc(sizeof(Node));
+    *images = (Node){
+        .type = FileList,
+        .name = strdup(name),
+        .u = { .filelist = { .count = nimages, .filenames = imagenames } }
+    };
+    addsheet(images, NULL, nimages, name);
+    if(!sheetcolumns) {
+        sheets[nsheets - 1].pageouts = malloc(nimages * sizeof(char *));
+        for(i = 0; i < nimages; i++)
+            sheets[nsheets - 1].pageouts[i] = thumbout(imagenames[i]);
+    }
+}
+
+void
+thumbnails(int argc, char *argv[]) {
+    Node **dirs = calloc(argc, sizeof(Node *));
+    pthread_t *threads;
+    int i, j, ndirs = 0, nthumbs = 0, nfiles = 0;
+    char **files = calloc(argc, sizeof(char *));
+
+    if(mkdir(thumbdir, 0755) == -1 && errno != EEXIST)
+        die("Failed to create %s: %s\n", thumbdir, strerror(errno));
+    skipbad = 1;
+
+    /* the files of a directory are read as its own inputs, the loose
+     * images of the others share a sheet */
+    for(i = 0; i < argc; i++) {
+        if(!(dirs[ndirs] = dirnode(NULL, argv[i]))) {
+            files[nfiles++] = argv[i];
+            continue;
+        }
+        dirwait(dirs[ndirs], INT_MAX);
+        addfiles(FL(dirs[ndirs]).filenames, FL(dirs[ndirs]).count, argv[i]);
+        ndirs++;
+    }
+    addfiles(files, nfiles, "images");
+
+    for(i = 0; i < nsheets; i++) {
+        pthread_mutex_init(&sheets[i].lock, NULL);
+        nthumbs += sheets[i].count;
+    }
+    thumbs = malloc(nthumbs * sizeof(Thumb));
+    for(i = nthumbs = 0; i < nsheets; i++) {
+        if(sheets[i].sequential) {
+            thumbs[nthumbs++] = (Thumb){ .sheet = &sheets[i], .idx = 0, .count = sheets[i].count };
+            continue;
+        }
+        for(j = 0; j < sheets[i].count; j++)
+            thumbs[nthumbs++] = (Thumb){ .sheet = &sheets[i], .idx = j, .count = 1 };
+    }
+    nruns = MAX(MIN(sysconf(_SC_NPROCESSORS_ONLN), nthumbs), 1);
+    runs = calloc(nruns, sizeof(Run));
+    threads = calloc(nruns, sizeof(pthread_t));
+    for(i = 0; i < nruns; i++) {
+        pthread_mutex_init(&runs[i].lock, NULL);
+        runs[i].lo = (long)nthumbs * i / nruns;
+        runs[i].hi = (long)nthumbs * (i + 1) / nruns;
+    }
+    for(i = 1; i < nruns; i++)
+        if(pthread_create(&threads[i], NULL, thumbworker, &runs[i]))
+            die("Failed to create thumbnail worker\n");
+    thumbworker(&runs[0]);
+    for(i = 1; i < nruns; i++)
+        pthread_join(threads[i], NULL);
+
+    for(i = 0; i < nsheets; i++) {
+        if(!sheets[i].path) {
+            free((char **)FL(sheets[i].container).filenames);
+            cleanupnode(sheets[i].container);
+        }
+        pthread_mutex_destroy(&sheets[i].lock);
+        free(sheets[i].pageouts);
+    }
+    for(i = 0; i < ndirs; i++)
+        cleanupnode(dirs[i]);
+    for(i = 0; i < nouts; i++)
+        free(outs[i]);
+    free(outs);
+    for(i = 0; i < nruns; i++)
+        pthread_mutex_destroy(&runs[i].lock);
+    free(dirs);
+    free(files);
+    free(sheets);
+    free(thumbs);
+    free(runs);
+    free(threads);
 }
 
 void
 usage(void) {
-    fputs("usage: comic [-d] [filename]\n", stderr);
+    fputs("usage: comic [-d] [-m cachemb] [-n name] [-T dir [-c columns]] [filename]\n", stderr);
     exit(EXIT_FAILURE);
 }
 
@@ -729,26 +4815,50 @@ main(int argc, char *argv[]) {
     case 'd':
         imageperpage = 2;
         break;
+    case 'm':
+        cachelimit = strtoul(EARGF(usage()), NULL, 10) << 20;
+        break;
     case 'n':
         wmname = EARGF(usage());
         break;
+    case 'T':
+        thumbdir = EARGF(usage());
+        break;
+    case 'c':
+        sheetcolumns = atoi(EARGF(usage()));
+        sheetcolumns = MAX(sheetcolumns, 0);
+        break;
     } ARGEND;
 
     if(argc == 0)
         usage();
 
-    node = malloc(sizeof(Node));
-    *node = (Node){
-        .type = FileList,
-        .name = strdup(wmname),
-        .parent = NULL,
-        .u = { .filelist = { .idx = 0, .count = argc, .filenames = argv } }
-    };
-    curnode = node;
+    poolinit(POOL_IDLE, POOL_HUGEPAGES);
+#ifdef TRACE
+    traceinit();
+#endif
+    if(thumbdir)
+        thumbnails(argc, argv);
+    else {
+        node = malloc(sizeof(Node));
+        *node = (Node){
+            .type = FileList,
+            .name = strdup(wmname),
+            .parent = NULL,
+            .u = { .filelist = { .idx = 0, .count = argc, .filenames = argv } }
+        };
+        curnode = node;
 
-    setup();
-    run();
-    cleanup();
+        setup();
+        run();
+        cleanup();
+    }
+#ifdef TRACE
+    if(tracenow() > 0)
+        poolreport(stderr);
+    tracedump();
+#endif
 
     return EXIT_SUCCESS;
 }
+#endif
@@ -1,6 +1,32 @@
 #define ARCHIVE_BLOCK_SIZE  1024 * 16
-#define IMAGE_SIZE_LIMIT    1000 * 1000 * 10
 #define TITLE_LENGTH_LIMIT  1024
+#define PREFETCH_THREADS    2   /* decode-ahead workers */
+#define PREFETCH_PAGES      2   /* pages decoded ahead in the seek direction */
+#define SCAN_THREADS        4   /* listing the subdirectories of a directory */
+#define INDEX_THREADS       2   /* counting the pages of the inputs in the background */
+#define DECODE_THREADS      0   /* decoding a huge JPEG at its restart markers, 0 for one per core */
+#define DECODE_BANDS_PIXELS (8 << 20)   /* source pixels from which JPEGs decode in bands */
+#define CACHE_LIMIT         (256 << 20) /* bytes of decoded pages kept, -m */
+#define POOL_IDLE           (64 << 20)  /* bytes of unused page buffers kept for reuse */
+#define POOL_HUGEPAGES      0   /* page buffers on transparent huge pages */
+#define THUMB_SIZE          256 /* pixels of a thumbnail cell, -T */
+#define SHEET_COLUMNS       8   /* cells per contact sheet row, 0 writes pages alone, -c */
+#define THUMB_QUALITY       85
+#define THUMB_BACKGROUND    0x20    /* gray level around thumbnails */
+#define GRID_SIZE           160 /* pixels of a grid overview thumbnail, g */
+#define GRID_GAP            12
+#define GRID_SELECTION      0x80    /* gray level around the selected thumbnail */
+#define GRID_MISSING        0x30    /* gray level of thumbnails not made yet */
+#define RESIZE_DELAY        50  /* ms a window resize settles before the page is rendered */
+#define ZOOM_STEP           1.25    /* per zoom key, of the page fitting the view */
+#define ZOOM_MAX            16
+#define PAN_STEP            .25     /* of the view, per pan key */
+#define MIP_TILE            256     /* pixels of the squares zoomed out copies are made in */
+#define MIP_MARGIN          8       /* source pixels around a view the filter reads */
+
+/* resampling filter: Nearest, Bilinear, Bicubic or Lanczos, the others
+ * smoother but slower */
+static int filter = Nearest;
 
 #define MODKEY Mod1Mask
 static Key keys[] = {
@@ -10,8 +36,36 @@ static Key keys[] = {
     { 0,              XK_n,      seek,          {.i = 1 } },
     { 0,              XK_b,      seek,          {.i = -10 } },
     { 0,              XK_f,      seek,          {.i = 10 } },
-    { 0,              XK_comma,  seekabs,       {.i = -1 } },
-    { 0,              XK_period, seekabs,       {.i = 1 } },
+    { 0,              XK_comma,  shiftimage,    {.i = -1 } },   /* realigns spreads */
+    { 0,              XK_period, shiftimage,    {.i = 1 } },
+    { 0,              XK_Home,   seekabs,       {.i = 0 } },    /* first page */
+    { 0,              XK_End,    seekabs,       {.i = -1 } },   /* last page */
+    { 0,              XK_s,      cyclefilter,   {.i = 1 } },
+    { 0,              XK_g,      togglegrid,    { 0 } },
+    { 0,              XK_Escape, togglegrid,    {.i = -1 } },  /* leaves only */
+    { 0,              XK_Return, gridselect,    { 0 } },
+    { 0,              XK_h,      gridmove,      {.i = -1 } },
+    { 0,              XK_l,      gridmove,      {.i = 1 } },
+    { 0,              XK_k,      gridrow,       {.i = -1 } },
+    { 0,              XK_j,      gridrow,       {.i = 1 } },
+    { 0,              XK_Left,   gridmove,      {.i = -1 } },
+    { 0,              XK_Right,  gridmove,      {.i = 1 } },
+    { 0,              XK_Up,     gridrow,       {.i = -1 } },
+    { 0,              XK_Down,   gridrow,       {.i = 1 } },
+    { 0,              XK_equal,  zoomview,      {.i = 1 } },
+    { 0,              XK_minus,  zoomview,      {.i = -1 } },
+    { 0,              XK_0,      zoomview,      { 0 } },
+    { 0,              XK_KP_Add, zoomview,      {.i = 1 } },
+    { 0,              XK_KP_Subtract, zoomview, {.i = -1 } },
+    /* the grid keys pan a zoomed page */
+    { 0,              XK_h,      panx,          {.i = -1 } },
+    { 0,              XK_l,      panx,          {.i = 1 } },
+    { 0,              XK_k,      pany,          {.i = -1 } },
+    { 0,              XK_j,      pany,          {.i = 1 } },
+    { 0,              XK_Left,   panx,          {.i = -1 } },
+    { 0,              XK_Right,  panx,          {.i = 1 } },
+    { 0,              XK_Up,     pany,          {.i = -1 } },
+    { 0,              XK_Down,   pany,          {.i = 1 } },
 };
 
 static Button buttons[] = {
@@ -3,6 +3,13 @@ VERSION = 0.1
 
 # Options
 ARCHIVE_SUPPORT = 0
+PNG_SUPPORT = 1
+# needs libwebp
+WEBP_SUPPORT = 0
+# pages scaled by the X server, unless COMIC_NORENDER is set
+XRENDER_SUPPORT = 1
+# trace spans of the page path, recorded when COMIC_TRACE is set
+TRACE_SUPPORT = 0
 
 # paths
 PREFIX = /usr/local
@@ -13,11 +20,11 @@ X11LIB = /usr/X11R6/lib
 
 # includes and libs
 INCS = -I. -I/usr/include -I${X11INC}
-LIBS = -L/usr/local/lib -lc -L${X11LIB} -lX11 -ljpeg
+LIBS = -L/usr/local/lib -lc -L${X11LIB} -lX11 -lXext -ljpeg -lpthread -lm
 
 # flags
 CPPFLAGS = -DVERSION=\"${VERSION}\" -D_BSD_SOURCE -D_GNU_SOURCE
-CFLAGS = -std=c99 -pedantic -Wall -Os ${INCS} ${CPPFLAGS} \
+CFLAGS = -std=c99 -pedantic -Wall -Os -pthread ${INCS} ${CPPFLAGS} \
 	-Wall -Werror -Wno-deprecated-declarations -g -ggdb
 
 LDFLAGS = -g ${LIBS}
@@ -30,3 +37,22 @@ ifeq (${ARCHIVE_SUPPORT}, 1)
 LIBS += -larchive
 CFLAGS += -DARCHIVE
 endif
+
+ifeq (${PNG_SUPPORT}, 1)
+LIBS += -lpng
+CFLAGS += -DPNG
+endif
+
+ifeq (${WEBP_SUPPORT}, 1)
+LIBS += -lwebp
+CFLAGS += -DWEBP
+endif
+
+ifeq (${XRENDER_SUPPORT}, 1)
+LIBS += -lXrender
+CFLAGS += -DXRENDER
+endif
+
+ifeq (${TRACE_SUPPORT}, 1)
+CFLAGS += -DTRACE
+endif
@@ -0,0 +1,338 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Writes a synthetic comic corpus for comic-bench: single JPEG pages of
+ * several sizes, gray and color, baseline and progressive, a tall scan with
+ * restart markers, and the same kind of pages packed into stored and
+ * deflated CBZ files and a tar. */
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <jpeglib.h>
+#include <zlib.h>
+
+#define ARCHIVE_PAGES 12
+
+typedef struct {
+    const char *name;
+    int width, height, gray, progressive, restart;
+} Spec;
+
+static const Spec pagespecs[] = {
+    { "small-color",    800,  1200, 0, 0 },
+    { "small-gray",     800,  1200, 1, 0 },
+    { "medium-color",   1600, 2400, 0, 0 },
+    { "medium-gray",    1600, 2400, 1, 0 },
+    { "medium-prog",    1600, 2400, 0, 1 },
+    { "large-color",    3200, 4800, 0, 0 },
+    { "large-gray",     3200, 4800, 1, 1 },
+    { "spread-color",   4800, 3200, 0, 0 },
+    { "tall-restart",   2400, 20000, 0, 0, 1 },
+};
+
+typedef struct {
+    char *name;
+    unsigned char *data;
+    unsigned long size;
+} Entry;
+
+static uint32_t seed = 1;
+
+static void
+die(const char *errstr, ...) {
+    va_list ap;
+
+    va_start(ap, errstr);
+    vfprintf(stderr, errstr, ap);
+    va_end(ap);
+    exit(EXIT_FAILURE);
+}
+
+static uint32_t
+rnd(uint32_t n) {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % n;
+}
+
+/* Panels with gradient fills, ink strokes and speech bubbles on paper */
+static unsigned char *
+drawpage(int w, int h, int comps) {
+    unsigned char *buf, *p, ink[3];
+    int i, j, x, y, c, rows, cols, px, py, pw, ph, border = w / 200 + 1;
+    int x0, y0, x1, y1, cx, cy, rx, ry, len;
+
+    if(!(buf = malloc((size_t)w * h * comps)))
+        die("Failed to allocate a %dx%d page\n", w, h);
+    memset(buf, 0xf4, (size_t)w * h * comps);
+
+    rows = 3 + rnd(2);
+    for(i = 0; i < rows; i++) {
+        cols = 1 + rnd(3);
+        for(j = 0; j < cols; j++) {
+            px = w / 20 + j * (w * 9 / 10) / cols;
+            py = h / 20 + i * (h * 9 / 10) / rows;
+            pw = (w * 9 / 10) / cols - w / 40;
+            ph = (h * 9 / 10) / rows - h / 40;
+            for(c = 0; c < 3; c++)
+                ink[c] = 96 + rnd(160);
+            for(y = py; y < py + ph; y++) {
+                p = buf + ((size_t)y * w + px) * comps;
+                for(x = 0; x < pw; x++, p += comps) {
+                    if(x < border || y < py + border || x >= pw - border || y >= py + ph - border) {
+                        memset(p, 0x10, comps);
+                        continue;
+                    }
+                    for(c = 0; c < comps; c++)
+                        p[c] = ink[c] * (ph + y - py) / (2 * ph) + ((x ^ y) & 7);
+                }
+            }
+            /* strokes */
+            for(len = 0; len < 40; len++) {
+                x0 = px + rnd(pw);
+                y0 = py + rnd(ph);
+                x1 = px + rnd(pw);
+                y1 = py + rnd(ph);
+                for(c = 0; c <= 256; c++) {
+                    x = x0 + (x1 - x0) * c / 256;
+                    y = y0 + (y1 - y0) * c / 256;
+                    memset(buf + ((size_t)y * w + x) * comps, 0x18, comps);
+                }
+            }
+            /* a bubble */
+            rx = pw / 6 + 1;
+            ry = ph / 8 + 1;
+            cx = px + rx + border + rnd(pw - 2 * rx - 2 * border);
+            cy = py + ry + border + rnd(ph - 2 * ry - 2 * border);
+            for(y = cy - ry; y < cy + ry; y++)
+                for(x = cx - rx; x < cx + rx; x++) {
+                    double d = (double)(x - cx) * (x - cx) / ((double)rx * rx) +
+                            (double)(y - cy) * (y - cy) / ((double)ry * ry);
+                    if(d <= 1)
+                        memset(buf + ((size_t)y * w + x) * comps, d > .92 ? 0x10 : 0xff, comps);
+                }
+        }
+    }
+    return buf;
+}
+
+static Entry
+encodepage(const Spec *spec, const char *name) {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    JSAMPROW row;
+    Entry e = { .name = strdup(name) };
+    int comps = spec->gray ? 1 : 3;
+    unsigned char *pixels = drawpage(spec->width, spec->height, comps);
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &e.data, &e.size);
+    cinfo.image_width = spec->width;
+    cinfo.image_height = spec->height;
+    cinfo.input_components = comps;
+    cinfo.in_color_space = spec->gray ? JCS_GRAYSCALE : JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 85, TRUE);
+    if(spec->progressive)
+        jpeg_simple_progression(&cinfo);
+    cinfo.restart_in_rows = spec->restart;
+    jpeg_start_compress(&cinfo, TRUE);
+    while(cinfo.next_scanline < cinfo.image_height) {
+        row = pixels + (size_t)cinfo.next_scanline * spec->width * comps;
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    free(pixels);
+    return e;
+}
+
+static FILE *
+create(const char *dir, const char *name) {
+    char path[4096];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if(!(f = fopen(path, "wb")))
+        die("Failed to create %s: %s\n", path, strerror(errno));
+    printf("%s\n", path);
+    return f;
+}
+
+static void
+put16(FILE *f, unsigned v) {
+    fputc(v & 0xff, f);
+    fputc(v >> 8 & 0xff, f);
+}
+
+static void
+put32(FILE *f, unsigned long v) {
+    put16(f, v & 0xffff);
+    put16(f, v >> 16 & 0xffff);
+}
+
+static unsigned char *
+deflateentry(const Entry *e, unsigned long *size) {
+    z_stream z = { 0 };
+    unsigned char *out;
+
+    if(deflateInit2(&z, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        die("Failed to initialize deflate\n");
+    *size = deflateBound(&z, e->size);
+    if(!(out = malloc(*size)))
+        die("Failed to allocate deflate buffer\n");
+    z.next_in = e->data;
+    z.avail_in = e->size;
+    z.next_out = out;
+    z.avail_out = *size;
+    if(deflate(&z, Z_FINISH) != Z_STREAM_END)
+        die("Failed to deflate %s\n", e->name);
+    *size = z.total_out;
+    deflateEnd(&z);
+    return out;
+}
+
+/* A zip of entries, stored or deflated */
+static void
+writezip(FILE *f, Entry *entries, int count, int compress) {
+    unsigned long crc[ARCHIVE_PAGES], csize[ARCHIVE_PAGES], offset[ARCHIVE_PAGES];
+    unsigned long cdstart, cdsize;
+    unsigned char *data;
+    int method[ARCHIVE_PAGES], i, len;
+
+    for(i = 0; i < count; i++) {
+        len = strlen(entries[i].name);
+        crc[i] = crc32(0, entries[i].data, entries[i].size);
+        data = entries[i].data;
+        csize[i] = entries[i].size;
+        method[i] = 0;
+        if(compress) {
+            data = deflateentry(&entries[i], &csize[i]);
+            method[i] = 8;
+        }
+        offset[i] = ftell(f);
+        put32(f, 0x04034b50);
+        put16(f, 20);
+        put16(f, 0);
+        put16(f, method[i]);
+        put32(f, 0);
+        put32(f, crc[i]);
+        put32(f, csize[i]);
+        put32(f, entries[i].size);
+        put16(f, len);
+        put16(f, 0);
+        fwrite(entries[i].name, 1, len, f);
+        fwrite(data, 1, csize[i], f);
+        if(data != entries[i].data)
+            free(data);
+    }
+
+    cdstart = ftell(f);
+    for(i = 0; i < count; i++) {
+        len = strlen(entries[i].name);
+        put32(f, 0x02014b50);
+        put16(f, 20);
+        put16(f, 20);
+        put16(f, 0);
+        put16(f, method[i]);
+        put32(f, 0);
+        put32(f, crc[i]);
+        put32(f, csize[i]);
+        put32(f, entries[i].size);
+        put16(f, len);
+        put16(f, 0);
+        put16(f, 0);
+        put16(f, 0);
+        put16(f, 0);
+        put32(f, 0644 << 16);
+        put32(f, offset[i]);
+        fwrite(entries[i].name, 1, len, f);
+    }
+    cdsize = ftell(f) - cdstart;
+
+    put32(f, 0x06054b50);
+    put16(f, 0);
+    put16(f, 0);
+    put16(f, count);
+    put16(f, count);
+    put32(f, cdsize);
+    put32(f, cdstart);
+    put16(f, 0);
+}
+
+static void
+writetar(FILE *f, Entry *entries, int count) {
+    unsigned char header[512], zero[1024] = { 0 };
+    unsigned sum;
+    int i, j;
+
+    for(i = 0; i < count; i++) {
+        memset(header, 0, sizeof(header));
+        snprintf((char *)header, 100, "%s", entries[i].name);
+        snprintf((char *)header + 100, 8, "%07o", 0644);
+        snprintf((char *)header + 108, 8, "%07o", 0);
+        snprintf((char *)header + 116, 8, "%07o", 0);
+        snprintf((char *)header + 124, 12, "%011lo", entries[i].size);
+        snprintf((char *)header + 136, 12, "%011o", 0);
+        header[156] = '0';
+        memcpy(header + 257, "ustar", 6);
+        memcpy(header + 263, "00", 2);
+        memset(header + 148, ' ', 8);
+        for(sum = 0, j = 0; j < 512; j++)
+            sum += header[j];
+        snprintf((char *)header + 148, 8, "%06o", sum);
+        fwrite(header, 1, 512, f);
+        fwrite(entries[i].data, 1, entries[i].size, f);
+        fwrite(zero, 1, (512 - entries[i].size % 512) % 512, f);
+    }
+    fwrite(zero, 1, sizeof(zero), f);
+}
+
+int
+main(int argc, char *argv[]) {
+    Entry pages[ARCHIVE_PAGES], e;
+    Spec spec;
+    FILE *f;
+    char name[64];
+    int i;
+
+    if(argc != 2)
+        die("usage: gencorpus directory\n");
+    if(mkdir(argv[1], 0755) == -1 && errno != EEXIST)
+        die("Failed to create %s: %s\n", argv[1], strerror(errno));
+
+    for(i = 0; i < sizeof(pagespecs) / sizeof(pagespecs[0]); i++) {
+        snprintf(name, sizeof(name), "%s.jpg", pagespecs[i].name);
+        e = encodepage(&pagespecs[i], name);
+        f = create(argv[1], name);
+        fwrite(e.data, 1, e.size, f);
+        fclose(f);
+        free(e.data);
+        free(e.name);
+    }
+
+    /* a chapter of medium pages, every third one gray */
+    for(i = 0; i < ARCHIVE_PAGES; i++) {
+        spec = (Spec){ NULL, 1600, 2400, i % 3 == 2, i == 0 };
+        snprintf(name, sizeof(name), "chapter/%03d.jpg", i + 1);
+        pages[i] = encodepage(&spec, name);
+    }
+    f = create(argv[1], "stored.cbz");
+    writezip(f, pages, ARCHIVE_PAGES, 0);
+    fclose(f);
+    f = create(argv[1], "deflated.cbz");
+    writezip(f, pages, ARCHIVE_PAGES, 1);
+    fclose(f);
+    f = create(argv[1], "chapter.tar");
+    writetar(f, pages, ARCHIVE_PAGES);
+    fclose(f);
+
+    for(i = 0; i < ARCHIVE_PAGES; i++) {
+        free(pages[i].data);
+        free(pages[i].name);
+    }
+    return EXIT_SUCCESS;
+}
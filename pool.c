@@ -0,0 +1,166 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Buffers of a page are large enough that malloc maps and unmaps them every
+ * time, so each page turn faults in its memory anew. Here sizes are rounded
+ * up to classes an eighth of a power of two apart and buffers handed back
+ * are kept, the newest first, up to a limit of idle bytes. A buffer is
+ * reused for any size up to half of it, its pages being faulted in already.
+ * Smaller buffers still come from malloc. */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "pool.h"
+
+#define HEADER      64          /* before a buffer, keeping it aligned */
+#define POOL_MIN    (64 << 10)  /* bytes from which buffers are pooled */
+#define HUGEPAGE    (2 << 20)
+
+typedef struct Buf Buf;
+struct Buf {
+    size_t size;    /* of the mapping, 0 when malloced */
+    Buf *next;      /* idle after this one */
+};
+
+typedef struct {
+    size_t gets, hits;      /* pooled buffers asked for, and of them reused */
+    size_t resident, idle;  /* bytes mapped, and of them not in use */
+} PoolStats;
+
+static pthread_mutex_t poollock = PTHREAD_MUTEX_INITIALIZER;
+static Buf *idlelist;
+static PoolStats stats;
+static size_t idlelimit = 64 << 20;
+static int hugepages;
+
+void
+poolinit(size_t idle, int huge) {
+    idlelimit = idle;
+    hugepages = huge;
+}
+
+static size_t
+classsize(size_t size) {
+    size_t step = 4096;
+
+    while(step * 8 < size)
+        step <<= 1;
+    return (size + step - 1) & ~(step - 1);
+}
+
+/* Maps size bytes, at a huge page boundary when they are to be huge pages */
+static Buf *
+mapbuf(size_t size) {
+    unsigned char *p;
+    size_t extra = 0;
+
+#ifdef MADV_HUGEPAGE
+    if(hugepages && size >= HUGEPAGE)
+        extra = HUGEPAGE;
+#endif
+    p = mmap(NULL, size + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    if(extra) {
+        unsigned char *q = (unsigned char *)(((uintptr_t)p + HUGEPAGE - 1) & ~(uintptr_t)(HUGEPAGE - 1));
+        if(q > p)
+            munmap(p, q - p);
+        if(q < p + extra)
+            munmap(q + size, p + extra - q);
+        madvise(q, size, MADV_HUGEPAGE);
+        p = q;
+    }
+#endif
+    ((Buf *)p)->size = size;
+    return (Buf *)p;
+}
+
+void *
+poolget(size_t size) {
+    Buf *b = NULL, **p, **best;
+
+    if(size + HEADER < POOL_MIN) {
+        if(!(b = malloc(size + HEADER)))
+            return NULL;
+        b->size = 0;
+        return (unsigned char *)b + HEADER;
+    }
+    size = classsize(size + HEADER);
+
+    pthread_mutex_lock(&poollock);
+    stats.gets++;
+    /* the smallest idle one that is not twice too large */
+    for(best = NULL, p = &idlelist; *p; p = &(*p)->next)
+        if((*p)->size >= size && (*p)->size < 2 * size && (!best || (*p)->size < (*best)->size))
+            best = p;
+    if(best) {
+        b = *best;
+        *best = b->next;
+        stats.hits++;
+        stats.idle -= b->size;
+    }
+    pthread_mutex_unlock(&poollock);
+
+    if(!b) {
+        if(!(b = mapbuf(size)))
+            return NULL;
+        pthread_mutex_lock(&poollock);
+        stats.resident += size;
+        pthread_mutex_unlock(&poollock);
+    }
+    return (unsigned char *)b + HEADER;
+}
+
+void
+poolput(void *buf) {
+    Buf *b, *unmap = NULL, **p;
+
+    if(!buf)
+        return;
+    b = (Buf *)((unsigned char *)buf - HEADER);
+    if(!b->size) {
+        free(b);
+        return;
+    }
+
+    pthread_mutex_lock(&poollock);
+    /* the buffers unused for longest make room */
+    while(idlelist && stats.idle + b->size > idlelimit) {
+        for(p = &idlelist; (*p)->next; p = &(*p)->next);
+        stats.idle -= (*p)->size;
+        (*p)->next = unmap;
+        unmap = *p;
+        *p = NULL;
+    }
+    if(stats.idle + b->size > idlelimit) {
+        b->next = unmap;
+        unmap = b;
+    } else {
+        b->next = idlelist;
+        idlelist = b;
+        stats.idle += b->size;
+    }
+    for(b = unmap; b; b = b->next)
+        stats.resident -= b->size;
+    pthread_mutex_unlock(&poollock);
+
+    while((b = unmap)) {
+        unmap = b->next;
+        munmap(b, b->size);
+    }
+}
+
+void
+poolreport(FILE *f) {
+    PoolStats st;
+
+    pthread_mutex_lock(&poollock);
+    st = stats;
+    pthread_mutex_unlock(&poollock);
+    fprintf(f, "pool: %zu of %zu buffers reused (%.1f%%), %.1f MiB resident, %.1f MiB idle\n",
+            st.hits, st.gets, st.gets ? 100. * st.hits / st.gets : 0.,
+            st.resident / 1048576., st.idle / 1048576.);
+}
@@ -0,0 +1,15 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Pixel buffers handed back are kept for the next page of about the same
+ * size, instead of being unmapped and faulted in again. */
+
+/* Keeps up to idle bytes of unused buffers, on transparent huge pages when
+ * hugepages is set */
+void poolinit(size_t idle, int hugepages);
+/* A buffer of at least size bytes, its contents undefined, NULL when out
+ * of memory */
+void *poolget(size_t size);
+/* Gives a buffer from poolget back, NULL is ignored */
+void poolput(void *buf);
+/* Prints the share of buffers reused and the bytes the pool holds on f */
+void poolreport(FILE *f);
@@ -0,0 +1,566 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Separable resampler: every output pixel is a weighted sum of a few source
+ * pixels, first along columns (vpass) into one filtered row, then along that
+ * row (hpass). Weights are 14 bit fixed point, and the tables of the last
+ * few geometries are kept, so that frames and thumbnails of pages sized
+ * alike do not compute them again. The passes have SSE2 and AVX2
+ * versions picked at runtime.
+ * Gray sources are filtered at one byte per pixel, the horizontal pass
+ * spreading each level over the four bytes of its output. */
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD
+#include <immintrin.h>
+#endif
+
+#include "resample.h"
+
+#define PREC        14
+#define NCACHED     8
+#define MAX(A, B)   ((A) > (B) ? (A) : (B))
+#define MIN(A, B)   ((A) < (B) ? (A) : (B))
+
+/* Weights of count outputs: output i reads taps inputs from lo + start[i] */
+typedef struct {
+    int taps;       /* a multiple of align, padded with zero weights */
+    int lo, len;    /* source range under all outputs */
+    int *start;
+    int16_t *w;     /* taps weights per output */
+    int srclen, dstlen, first, count, filter, align;
+    int users;
+    unsigned long used;
+} Coeffs;
+
+typedef void (*hpassfunc)(const unsigned char *src, const Coeffs *c,
+        unsigned char *out, int count);
+typedef void (*vpassfunc)(const unsigned char **rows, const int16_t *w, int n,
+        unsigned char *out, int len);
+
+static double
+triangle(double x) {
+    x = fabs(x);
+    return x < 1 ? 1 - x : 0;
+}
+
+static double
+cubic(double x) {
+    const double a = -0.5;
+    x = fabs(x);
+    if(x < 1)
+        return ((a + 2) * x - (a + 3)) * x * x + 1;
+    if(x < 2)
+        return (((x - 5) * x + 8) * x - 4) * a;
+    return 0;
+}
+
+static double
+lanczos(double x) {
+    if(x == 0)
+        return 1;
+    if(x <= -3 || x >= 3)
+        return 0;
+    x *= M_PI;
+    return 3 * sin(x) * sin(x / 3) / (x * x);
+}
+
+static const struct {
+    const char *name;
+    double support;
+    double (*f)(double);
+} filters[] = {
+    [Nearest]  = { "nearest",  0, NULL },
+    [Bilinear] = { "bilinear", 1, triangle },
+    [Bicubic]  = { "bicubic",  2, cubic },
+    [Lanczos]  = { "lanczos",  3, lanczos },
+};
+
+const char *
+filtername(int filter) {
+    return filters[filter].name;
+}
+
+/* Source range [lo, hi) under the filter centered on output i */
+static void
+window(int i, double scale, double support, int srclen, int *lo, int *hi) {
+    double center = (i + 0.5) * scale;
+
+    *lo = MIN(MAX((int)(center - support + 0.5), 0), srclen - 1);
+    *hi = MAX(MIN((int)(center + support + 0.5), srclen), *lo + 1);
+}
+
+/* Weights of outputs first to first + count of srclen scaled to dstlen */
+static Coeffs *
+coeffs(int srclen, int dstlen, int first, int count, int filter, int align) {
+    int i, k, lo, hi, off, big;
+    double scale = (double)srclen / dstlen, fscale = MAX(scale, 1.0);
+    double support = filters[filter].support * fscale, sum;
+    double *w;
+    Coeffs *c = malloc(sizeof(Coeffs));
+
+    *c = (Coeffs){ .srclen = srclen, .dstlen = dstlen, .first = first,
+        .count = count, .filter = filter, .align = align };
+    /* same tap count for every output, so the kernels need no tail */
+    c->taps = align;
+    for(i = 0; i < count; i++) {
+        window(first + i, scale, support, srclen, &lo, &hi);
+        c->taps = MAX(c->taps, (hi - lo + align - 1) / align * align);
+    }
+    c->start = malloc(sizeof(int) * count);
+    c->w = calloc((size_t)count * c->taps, sizeof(int16_t));
+    w = malloc(sizeof(double) * c->taps);
+
+    for(i = 0; i < count; i++) {
+        window(first + i, scale, support, srclen, &lo, &hi);
+        sum = 0;
+        for(k = 0; k < hi - lo; k++)
+            sum += w[k] = filters[filter].f((lo + k + 0.5 - (first + i + 0.5) * scale) / fscale);
+
+        /* shift windows near the end back so that all taps stay inside */
+        c->start[i] = MAX(MIN(lo, srclen - c->taps), 0);
+        off = i * c->taps + lo - c->start[i];
+
+        /* round to fixed point, keeping the exact sum on the largest weight */
+        big = 0;
+        for(k = 0; k < hi - lo; k++) {
+            c->w[off + k] = lrint((sum ? w[k] / sum : 1) * (1 << PREC));
+            if(w[k] > w[big])
+                big = k;
+        }
+        for(k = 0, sum = 0; k < hi - lo; k++)
+            sum += c->w[off + k];
+        c->w[off + big] += (1 << PREC) - (int)sum;
+    }
+    free(w);
+
+    c->lo = c->start[0];
+    c->len = MIN(c->start[count - 1] + c->taps, srclen) - c->lo;
+    for(i = 0; i < count; i++)
+        c->start[i] -= c->lo;
+    return c;
+}
+
+static void
+freecoeffs(Coeffs *c) {
+    free(c->start);
+    free(c->w);
+    free(c);
+}
+
+static Coeffs *cache[NCACHED];
+static unsigned long ticks;
+static pthread_mutex_t cachelock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The weights of a geometry, cached or computed and cached in place of
+ * the least recently used table not in use. Released with putcoeffs. */
+static Coeffs *
+getcoeffs(int srclen, int dstlen, int first, int count, int filter, int align) {
+    Coeffs *c;
+    int i, slot = -1;
+
+    pthread_mutex_lock(&cachelock);
+    for(i = 0; i < NCACHED; i++) {
+        c = cache[i];
+        if(c && c->srclen == srclen && c->dstlen == dstlen && c->first == first &&
+                c->count == count && c->filter == filter && c->align == align) {
+            c->users++;
+            c->used = ++ticks;
+            pthread_mutex_unlock(&cachelock);
+            return c;
+        }
+    }
+    pthread_mutex_unlock(&cachelock);
+
+    c = coeffs(srclen, dstlen, first, count, filter, align);
+    c->users = 1;
+    pthread_mutex_lock(&cachelock);
+    for(i = 0; i < NCACHED && cache[i]; i++)
+        if(!cache[i]->users && (slot == -1 || cache[i]->used < cache[slot]->used))
+            slot = i;
+    if(i < NCACHED)
+        slot = i;
+    if(slot != -1) {
+        if(cache[slot])
+            freecoeffs(cache[slot]);
+        cache[slot] = c;
+        c->used = ++ticks;
+    }
+    pthread_mutex_unlock(&cachelock);
+    return c;
+}
+
+static void
+putcoeffs(Coeffs *c) {
+    int i;
+
+    pthread_mutex_lock(&cachelock);
+    c->users--;
+    for(i = 0; i < NCACHED && cache[i] != c; i++);
+    if(i == NCACHED && !c->users)
+        freecoeffs(c);
+    pthread_mutex_unlock(&cachelock);
+}
+
+static unsigned char
+clamp(int v) {
+    v >>= PREC;
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static void
+hpass_c(const unsigned char *src, const Coeffs *c, unsigned char *out, int count) {
+    int i, k, ch, acc[4];
+    const unsigned char *p;
+    const int16_t *w;
+
+    for(i = 0; i < count; i++, out += 4) {
+        p = src + 4 * c->start[i];
+        w = c->w + i * c->taps;
+        acc[0] = acc[1] = acc[2] = acc[3] = 1 << (PREC - 1);
+        for(k = 0; k < c->taps; k++, p += 4)
+            for(ch = 0; ch < 4; ch++)
+                acc[ch] += w[k] * p[ch];
+        for(ch = 0; ch < 4; ch++)
+            out[ch] = clamp(acc[ch]);
+    }
+}
+
+static uint32_t
+graypixel(const unsigned char *p, const int16_t *w, int taps) {
+    int k, acc = 1 << (PREC - 1);
+
+    for(k = 0; k < taps; k++)
+        acc += w[k] * p[k];
+    return clamp(acc) * 0x01010101u;
+}
+
+static void
+hgray_c(const unsigned char *src, const Coeffs *c, unsigned char *out, int count) {
+    int i;
+
+    for(i = 0; i < count; i++)
+        ((uint32_t *)out)[i] = graypixel(src + c->start[i], c->w + i * c->taps, c->taps);
+}
+
+static void
+vpass_c(const unsigned char **rows, const int16_t *w, int n, unsigned char *out, int len) {
+    int i, k, acc;
+
+    for(i = 0; i < len; i++) {
+        acc = 1 << (PREC - 1);
+        for(k = 0; k < n; k++)
+            acc += w[k] * rows[k][i];
+        out[i] = clamp(acc);
+    }
+}
+
+#ifdef SIMD
+/* weights k and k + 1, as the halves of a _mm_madd_epi16 operand */
+static int32_t
+pair(const int16_t *w) {
+    int32_t v;
+
+    memcpy(&v, w, sizeof(v));
+    return v;
+}
+
+__attribute__((target("sse2"))) static void
+hpixel_sse2(const unsigned char *p, const int16_t *w, int taps, unsigned char *out) {
+    int k;
+    __m128i acc = _mm_set1_epi32(1 << (PREC - 1)), x;
+    const __m128i zero = _mm_setzero_si128();
+
+    for(k = 0; k < taps; k += 2, p += 8) {
+        /* a0 a1 a2 a3 b0 b1 b2 b3 -> a0 b0 a1 b1 a2 b2 a3 b3 */
+        x = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)p), zero);
+        x = _mm_unpacklo_epi16(x, _mm_srli_si128(x, 8));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(x, _mm_set1_epi32(pair(w + k))));
+    }
+    x = _mm_packs_epi32(_mm_srai_epi32(acc, PREC), zero);
+    *(int32_t *)out = _mm_cvtsi128_si32(_mm_packus_epi16(x, x));
+}
+
+__attribute__((target("sse2"))) static void
+hpass_sse2(const unsigned char *src, const Coeffs *c, unsigned char *out, int count) {
+    int i;
+
+    for(i = 0; i < count; i++, out += 4)
+        hpixel_sse2(src + 4 * c->start[i], c->w + i * c->taps, c->taps, out);
+}
+
+/* Four outputs at a time, tap pairs of each widened into one 32 bit lane */
+__attribute__((target("sse2"))) static void
+hgray_sse2(const unsigned char *src, const Coeffs *c, unsigned char *out, int count) {
+    int i, k;
+    const unsigned char *p0, *p1, *p2, *p3;
+    const int16_t *w0, *w1, *w2, *w3;
+    __m128i acc, x;
+    const __m128i round = _mm_set1_epi32(1 << (PREC - 1));
+
+    for(i = 0; i + 4 <= count; i += 4, out += 16) {
+        p0 = src + c->start[i];
+        p1 = src + c->start[i + 1];
+        p2 = src + c->start[i + 2];
+        p3 = src + c->start[i + 3];
+        w0 = c->w + i * c->taps;
+        w1 = w0 + c->taps;
+        w2 = w1 + c->taps;
+        w3 = w2 + c->taps;
+        acc = round;
+        for(k = 0; k < c->taps; k += 2) {
+            x = _mm_setr_epi32(p0[k] | p0[k + 1] << 16, p1[k] | p1[k + 1] << 16,
+                    p2[k] | p2[k + 1] << 16, p3[k] | p3[k + 1] << 16);
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(x, _mm_setr_epi32(pair(w0 + k),
+                    pair(w1 + k), pair(w2 + k), pair(w3 + k))));
+        }
+        /* clamped levels l0 l1 l2 l3, then each repeated four times */
+        x = _mm_srai_epi32(acc, PREC);
+        x = _mm_packus_epi16(_mm_packs_epi32(x, x), x);
+        x = _mm_unpacklo_epi8(x, x);
+        _mm_storeu_si128((__m128i *)out, _mm_unpacklo_epi16(x, x));
+    }
+    for(; i < count; i++, out += 4)
+        *(uint32_t *)out = graypixel(src + c->start[i], c->w + i * c->taps, c->taps);
+}
+
+__attribute__((target("sse2"))) static void
+vpass_sse2(const unsigned char **rows, const int16_t *w, int n, unsigned char *out, int len) {
+    int i, k;
+    __m128i a, b, lo, hi, wp, s0, s1, s2, s3;
+    const __m128i zero = _mm_setzero_si128(), round = _mm_set1_epi32(1 << (PREC - 1));
+
+    for(i = 0; i + 16 <= len; i += 16) {
+        s0 = s1 = s2 = s3 = round;
+        for(k = 0; k < n; k += 2) {
+            a = _mm_loadu_si128((const __m128i *)(rows[k] + i));
+            b = _mm_loadu_si128((const __m128i *)(rows[k + 1] + i));
+            wp = _mm_set1_epi32(pair(w + k));
+
+            lo = _mm_unpacklo_epi8(a, zero);
+            hi = _mm_unpacklo_epi8(b, zero);
+            s0 = _mm_add_epi32(s0, _mm_madd_epi16(_mm_unpacklo_epi16(lo, hi), wp));
+            s1 = _mm_add_epi32(s1, _mm_madd_epi16(_mm_unpackhi_epi16(lo, hi), wp));
+            lo = _mm_unpackhi_epi8(a, zero);
+            hi = _mm_unpackhi_epi8(b, zero);
+            s2 = _mm_add_epi32(s2, _mm_madd_epi16(_mm_unpacklo_epi16(lo, hi), wp));
+            s3 = _mm_add_epi32(s3, _mm_madd_epi16(_mm_unpackhi_epi16(lo, hi), wp));
+        }
+        lo = _mm_packs_epi32(_mm_srai_epi32(s0, PREC), _mm_srai_epi32(s1, PREC));
+        hi = _mm_packs_epi32(_mm_srai_epi32(s2, PREC), _mm_srai_epi32(s3, PREC));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(lo, hi));
+    }
+    if(i < len) {
+        for(k = 0; k < n; k++)
+            rows[k] += i;
+        vpass_c(rows, w, n, out + i, len - i);
+        for(k = 0; k < n; k++)
+            rows[k] -= i;
+    }
+}
+
+/* The sums of one output, tap pairs k, k + 1 in the low lane and
+ * k + 2, k + 3 in the high one */
+__attribute__((target("avx2"), always_inline)) static inline __m256i
+hsums_avx2(const unsigned char *p, const int16_t *w, int taps) {
+    int k;
+    __m256i acc = _mm256_setzero_si256(), x, wp;
+    const __m256i interleave = _mm256_setr_epi8(
+            0, 1, 8, 9, 2, 3, 10, 11, 4, 5, 12, 13, 6, 7, 14, 15,
+            0, 1, 8, 9, 2, 3, 10, 11, 4, 5, 12, 13, 6, 7, 14, 15);
+    const __m256i pairs = _mm256_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1);
+
+    for(k = 0; k < taps; k += 4, p += 16) {
+        x = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)p));
+        x = _mm256_shuffle_epi8(x, interleave);
+        wp = _mm256_permutevar8x32_epi32(_mm256_castsi128_si256(
+                _mm_loadl_epi64((const __m128i *)(w + k))), pairs);
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(x, wp));
+    }
+    return acc;
+}
+
+/* Four outputs at a time, four taps of one output per step */
+__attribute__((target("avx2"))) static void
+hpass_avx2(const unsigned char *src, const Coeffs *c, unsigned char *out, int count) {
+    int i;
+    const int16_t *w;
+    __m256i a0, a1, a2, a3, x;
+    const __m256i round = _mm256_set1_epi32(1 << (PREC - 1));
+
+    for(i = 0; i + 4 <= count; i += 4, out += 16) {
+        w = c->w + i * c->taps;
+        a0 = hsums_avx2(src + 4 * c->start[i], w, c->taps);
+        a1 = hsums_avx2(src + 4 * c->start[i + 1], w + c->taps, c->taps);
+        a2 = hsums_avx2(src + 4 * c->start[i + 2], w + 2 * c->taps, c->taps);
+        a3 = hsums_avx2(src + 4 * c->start[i + 3], w + 3 * c->taps, c->taps);
+        /* lane halves summed, outputs 0 and 2 in a0, 1 and 3 in a1 */
+        a0 = _mm256_add_epi32(_mm256_permute2x128_si256(a0, a2, 0x20),
+                _mm256_permute2x128_si256(a0, a2, 0x31));
+        a1 = _mm256_add_epi32(_mm256_permute2x128_si256(a1, a3, 0x20),
+                _mm256_permute2x128_si256(a1, a3, 0x31));
+        a0 = _mm256_srai_epi32(_mm256_add_epi32(a0, round), PREC);
+        a1 = _mm256_srai_epi32(_mm256_add_epi32(a1, round), PREC);
+        x = _mm256_packs_epi32(a0, a1);
+        x = _mm256_permute4x64_epi64(_mm256_packus_epi16(x, x), 0x08);
+        _mm_storeu_si128((__m128i *)out, _mm256_castsi256_si128(x));
+    }
+    for(; i < count; i++, out += 4)
+        hpixel_sse2(src + 4 * c->start[i], c->w + i * c->taps, c->taps, out);
+}
+
+/* Bytes of rows k and k + 1 interleaved, then widened against zero:
+ * the unpacks stay in their lanes, and so does the final pack */
+__attribute__((target("avx2"))) static void
+vpass_avx2(const unsigned char **rows, const int16_t *w, int n, unsigned char *out, int len) {
+    int i, k;
+    __m256i a, b, lo, hi, wp, s0, s1, s2, s3;
+    const __m256i zero = _mm256_setzero_si256(), round = _mm256_set1_epi32(1 << (PREC - 1));
+
+    for(i = 0; i + 32 <= len; i += 32) {
+        s0 = s1 = s2 = s3 = round;
+        for(k = 0; k < n; k += 2) {
+            a = _mm256_loadu_si256((const __m256i *)(rows[k] + i));
+            b = _mm256_loadu_si256((const __m256i *)(rows[k + 1] + i));
+            wp = _mm256_set1_epi32(pair(w + k));
+            lo = _mm256_unpacklo_epi8(a, b);
+            hi = _mm256_unpackhi_epi8(a, b);
+            s0 = _mm256_add_epi32(s0, _mm256_madd_epi16(_mm256_unpacklo_epi8(lo, zero), wp));
+            s1 = _mm256_add_epi32(s1, _mm256_madd_epi16(_mm256_unpackhi_epi8(lo, zero), wp));
+            s2 = _mm256_add_epi32(s2, _mm256_madd_epi16(_mm256_unpacklo_epi8(hi, zero), wp));
+            s3 = _mm256_add_epi32(s3, _mm256_madd_epi16(_mm256_unpackhi_epi8(hi, zero), wp));
+        }
+        lo = _mm256_packs_epi32(_mm256_srai_epi32(s0, PREC), _mm256_srai_epi32(s1, PREC));
+        hi = _mm256_packs_epi32(_mm256_srai_epi32(s2, PREC), _mm256_srai_epi32(s3, PREC));
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_packus_epi16(lo, hi));
+    }
+    if(i < len) {
+        for(k = 0; k < n; k++)
+            rows[k] += i;
+        vpass_c(rows, w, n, out + i, len - i);
+        for(k = 0; k < n; k++)
+            rows[k] -= i;
+    }
+}
+#endif
+
+static hpassfunc hpass, hgray;
+static vpassfunc vpass;
+static pthread_once_t dispatched = PTHREAD_ONCE_INIT;
+
+static void
+dispatch(void) {
+    hpass = hpass_c;
+    hgray = hgray_c;
+    vpass = vpass_c;
+#ifdef SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse2"))
+        hgray = hgray_sse2;
+    if(__builtin_cpu_supports("avx2")) {
+        hpass = hpass_avx2;
+        vpass = vpass_avx2;
+    } else if(__builtin_cpu_supports("sse2")) {
+        hpass = hpass_sse2;
+        vpass = vpass_sse2;
+    }
+#endif
+    if(getenv("COMIC_NOSIMD")) {
+        hpass = hpass_c;
+        hgray = hgray_c;
+        vpass = vpass_c;
+    }
+}
+
+/* A row of sw RGB24 pixels as BGRX32 in tmp */
+static void
+bgrx(const unsigned char *row, int sw, unsigned char *tmp) {
+    int x;
+    uint32_t *p = (uint32_t *)tmp;
+
+    for(x = 0; x < sw; x++, row += 3)
+        p[x] = (uint32_t)row[0] << 16 | row[1] << 8 | row[2];
+}
+
+static void
+nearest(const unsigned char *src, int sw, int sh, int sstride, int sfmt,
+        uint32_t *dst, int dstride, int dw, int dh, int x0, int y0, int w, int h) {
+    int x, y, *xs = malloc(sizeof(int) * w);
+    const unsigned char *row, *p;
+
+    for(x = 0; x < w; x++)
+        xs[x] = MIN((int)((x0 + x + 0.5) * sw / dw), sw - 1) * PIXELSIZE(sfmt);
+    for(y = 0; y < h; y++, dst += dstride) {
+        row = src + (size_t)MIN((int)((y0 + y + 0.5) * sh / dh), sh - 1) * sstride;
+        if(sfmt == GRAY8) {
+            for(x = 0; x < w; x++)
+                dst[x] = row[xs[x]] * 0x01010101u;
+            continue;
+        }
+        if(sfmt != RGB24) {
+            for(x = 0; x < w; x++)
+                dst[x] = *(const uint32_t *)(row + xs[x]);
+            continue;
+        }
+        for(x = 0; x < w; x++) {
+            p = row + xs[x];
+            dst[x] = p[0] << 16 | p[1] << 8 | p[2];
+        }
+    }
+    free(xs);
+}
+
+void
+resample(const unsigned char *src, int sw, int sh, int sstride, int sfmt,
+        uint32_t *dst, int dstride, int dw, int dh, int filter) {
+    resamplerect(src, sw, sh, sstride, sfmt, dst, dstride, dw, dh, 0, 0, dw, dh, filter);
+}
+
+void
+resamplerect(const unsigned char *src, int sw, int sh, int sstride, int sfmt,
+        uint32_t *dst, int dstride, int dw, int dh, int x, int y, int w, int h, int filter) {
+    int i, k, ps = PIXELSIZE(sfmt);
+    Coeffs *hc, *vc;
+    const unsigned char **rows;
+    unsigned char *line, *tmp;
+
+    /* thumbnail workers scale concurrently */
+    pthread_once(&dispatched, dispatch);
+    if(w <= 0 || h <= 0)
+        return;
+    if(filter == Nearest) {
+        nearest(src, sw, sh, sstride, sfmt, dst, dstride, dw, dh, x, y, w, h);
+        return;
+    }
+
+    /* the horizontal kernels take four taps at a time */
+    hc = getcoeffs(sw, dw, x, w, filter, 4);
+    vc = getcoeffs(sh, dh, y, h, filter, 2);
+    rows = malloc(sizeof(unsigned char *) * vc->taps);
+    /* only the source columns under the window are filtered, with spare
+     * pixels for the zero weight padding past the last one */
+    line = calloc(hc->len + hc->taps, 4);
+    tmp = sfmt == RGB24 ? calloc(hc->len + hc->taps, 4) : line;
+
+    /* columns first: pages mostly shrink, so rows are then filtered only
+     * once per output row */
+    for(i = 0; i < h; i++) {
+        for(k = 0; k < vc->taps; k++)
+            rows[k] = src + (size_t)MIN(vc->lo + vc->start[i] + k, sh - 1) * sstride + hc->lo * ps;
+        vpass(rows, vc->w + i * vc->taps, vc->taps, line, hc->len * ps);
+        if(sfmt == RGB24)
+            bgrx(line, hc->len, tmp);
+        (sfmt == GRAY8 ? hgray : hpass)(tmp, hc, (unsigned char *)(dst + (size_t)i * dstride), w);
+    }
+
+    if(tmp != line)
+        free(tmp);
+    free(line);
+    free(rows);
+    putcoeffs(hc);
+    putcoeffs(vc);
+}
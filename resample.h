@@ -0,0 +1,30 @@
+/* See LICENSE file for copyright and license details. */
+
+/* resampling filters */
+enum {
+    Nearest,
+    Bilinear,
+    Bicubic,
+    Lanczos,
+    FilterLast,
+};
+
+/* pixel formats */
+enum {
+    RGB24,      /* 3 bytes, r g b */
+    BGRX32,     /* 0x00rrggbb in LSBFirst byte order */
+    XRGB32,     /* 0x00rrggbb in MSBFirst byte order */
+    GRAY8,      /* 1 byte, the level */
+};
+
+#define PIXELSIZE(fmt)  ((fmt) == GRAY8 ? 1 : (fmt) == RGB24 ? 3 : 4)
+
+/* Scales src into dw * dh pixels of dst, rows dstride pixels apart. 32 bit
+ * sources keep their layout, RGB24 becomes BGRX32 and GRAY8 its level in
+ * every byte, which either 32 bit layout reads as gray */
+void resample(const unsigned char *src, int sw, int sh, int sstride, int sfmt,
+        uint32_t *dst, int dstride, int dw, int dh, int filter);
+/* The same, writing only the w * h window at x, y of the scaled image */
+void resamplerect(const unsigned char *src, int sw, int sh, int sstride, int sfmt,
+        uint32_t *dst, int dstride, int dw, int dh, int x, int y, int w, int h, int filter);
+const char *filtername(int filter);
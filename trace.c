@@ -0,0 +1,136 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Trace spans are kept in memory and written on exit as Chrome trace event
+ * JSON, which chrome://tracing and ui.perfetto.dev open, followed by the
+ * latency distribution of every stage on stderr. */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+typedef struct {
+    const char *name;
+    int tid;
+    double start, dur;
+} Span;
+
+static const char *tracefile;
+static double epoch;
+static pthread_mutex_t tracelock = PTHREAD_MUTEX_INITIALIZER;
+static Span *spans;
+static size_t count, size;
+
+/* upper bounds of the histogram buckets, in ms */
+static const double buckets[] = { .25, .5, 1, 2, 4, 8, 16, 32, 64, 128, 256 };
+
+static double
+clocknow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void
+traceinit(void) {
+    if(!(tracefile = getenv("COMIC_TRACE")) || !*tracefile)
+        tracefile = NULL;
+    epoch = clocknow();
+}
+
+double
+tracenow(void) {
+    return tracefile ? clocknow() - epoch : 0;
+}
+
+void
+traceadd(const char *name, double start) {
+    Span span;
+
+    if(!tracefile)
+        return;
+    span = (Span){ .name = name, .tid = syscall(SYS_gettid), .start = start,
+                   .dur = tracenow() - start };
+    pthread_mutex_lock(&tracelock);
+    if(count == size) {
+        size = size ? size * 2 : 4096;
+        if(!(spans = realloc(spans, size * sizeof(Span)))) {
+            /* losing the trace beats losing the session */
+            tracefile = NULL;
+            count = size = 0;
+            pthread_mutex_unlock(&tracelock);
+            return;
+        }
+    }
+    spans[count++] = span;
+    pthread_mutex_unlock(&tracelock);
+}
+
+static int
+cmpspan(const void *a, const void *b) {
+    const Span *x = a, *y = b;
+    int c;
+
+    if((c = strcmp(x->name, y->name)))
+        return c;
+    return (x->dur > y->dur) - (x->dur < y->dur);
+}
+
+static void
+summary(FILE *f) {
+    size_t i, j, n, bucket[sizeof(buckets) / sizeof(buckets[0]) + 1];
+    int b, nbuckets = sizeof(buckets) / sizeof(buckets[0]);
+
+    qsort(spans, count, sizeof(Span), cmpspan);
+    fprintf(f, "%-20s %7s %9s %9s %9s  ms:", "stage", "count", "p50 ms", "p99 ms", "max ms");
+    for(b = 0; b < nbuckets; b++)
+        fprintf(f, " <%g", buckets[b]);
+    fprintf(f, " more\n");
+    for(i = 0; i < count; i = j) {
+        for(j = i; j < count && !strcmp(spans[j].name, spans[i].name); j++);
+        n = j - i;
+        memset(bucket, 0, sizeof(bucket));
+        for(j = i; j < i + n; j++) {
+            for(b = 0; b < nbuckets && spans[j].dur * 1e3 >= buckets[b]; b++);
+            bucket[b]++;
+        }
+        fprintf(f, "%-20s %7zu %9.3f %9.3f %9.3f     ", spans[i].name, n,
+                spans[i + n / 2].dur * 1e3, spans[i + (n - 1) * 99 / 100].dur * 1e3,
+                spans[j - 1].dur * 1e3);
+        for(b = 0; b <= nbuckets; b++)
+            fprintf(f, " %zu", bucket[b]);
+        fputc('\n', f);
+    }
+}
+
+void
+tracedump(void) {
+    FILE *f;
+    size_t i;
+
+    if(!tracefile)
+        return;
+    pthread_mutex_lock(&tracelock);
+    if(!(f = fopen(tracefile, "w")))
+        fprintf(stderr, "comic: failed to write trace %s\n", tracefile);
+    else {
+        fputs("{\"traceEvents\":[\n", f);
+        for(i = 0; i < count; i++)
+            fprintf(f, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                    "\"ts\":%.3f,\"dur\":%.3f}%s\n", spans[i].name, (int)getpid(),
+                    spans[i].tid, spans[i].start * 1e6, spans[i].dur * 1e6,
+                    i + 1 < count ? "," : "");
+        fputs("],\"displayTimeUnit\":\"ms\"}\n", f);
+        fclose(f);
+    }
+    summary(stderr);
+    free(spans);
+    spans = NULL;
+    count = size = 0;
+    tracefile = NULL;
+    pthread_mutex_unlock(&tracelock);
+}
@@ -0,0 +1,20 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Spans around the stages of the page path. They exist only when built
+ * with TRACE, see config.mk, and record only while COMIC_TRACE is set. */
+#ifdef TRACE
+#define TRACEBEGIN(span)        double span = tracenow()
+#define TRACEEND(span, name)    traceadd(name, span)
+#else
+#define TRACEBEGIN(span)
+#define TRACEEND(span, name)
+#endif
+
+/* Starts recording when COMIC_TRACE names the trace file to write */
+void traceinit(void);
+/* Seconds since traceinit, 0 when not recording */
+double tracenow(void);
+/* Records a span called name, which must be a literal, up to now */
+void traceadd(const char *name, double start);
+/* Writes the Chrome trace and a summary per stage on stderr */
+void tracedump(void);